@@ -2,79 +2,103 @@
 /* 485 Modbus 协议 */
 
 
-ModbusRS485::ModbusRS485(HardwareSerial& serial, CRC16 *modbusCRC): RS485(serial), txFrame(modbusCRC), rxFrame(modbusCRC) {
+#if MODBUS_USE_RS485
+ModbusRS485::ModbusRS485(HardwareSerial& serial, CRC16 *modbusCRC): RS485(serial), txFrame(modbusCRC), rxFrame(modbusCRC), transport(&rs485Transport), rs485Transport(*this) {
+  init();
+}
+#else
+ModbusRS485::ModbusRS485(ModbusTransport& argTransport, CRC16 *modbusCRC): txFrame(modbusCRC), rxFrame(modbusCRC), transport(&argTransport) {
+  debugStream = 0;
+  init();
+}
+#endif
+
+void ModbusRS485::init(){
   onReceived = 0;
+  lastTick = 0;
+  sendBackStartTick = 0;
+  userData = 0;
   timeOut = 0;
   stopDelay = 0;
   rxFailPacks = 0;
   rxPacks = 0;
   txPacks = 0;
   debugReadPrint = false;
+  incrementalCRC = false;
+  earlyFrameCompletion = false;
+  transmitHook = 0;
+  transmitHookContext = 0;
+  rxIsResponse = false;
   setSendBackDelayRatio(10.0);
   clear();
 }
 
 uint8_t ModbusRS485::getSerialFrameLength(){
-  switch(serialConfig){
-    case SERIAL_8N1:
-      return 11; //1 start bit + 8 data bits + 1 stop bit + 2 CRC bytes
-    case SERIAL_8E1:
-    case SERIAL_8O1:
-      return 12; //1 start bit + 8 data bits + 1 parity bit + 1 stop bit + 2 CRC bytes
-    case SERIAL_8N2:
-      return 12; //1 start bit + 8 data bits + 2 stop bits + 2 CRC bytes
-    case SERIAL_8E2:
-    case SERIAL_8O2:
-      return 13; //1 start bit + 8 data bits + 1 parity bit + 2 stop bits + 2 CRC bytes
-    default:
-      return 11; //Default to SERIAL_8N1
-  }
-  return 11;
+  return ModbusTransport::getCharacterBits(serialConfig);
 }
 
 void ModbusRS485::clear(){
   state = ModbusRS485::WaitStation;
   failType = ModbusRS485::RcvNoFail; //Clear
   rxFrame.validDataLength = 0;
+  rxCRC = ModbusCRC::Init;
 }
 
+//按批读取: 一次readBytes取走所有可用字节, 每批只取一次时间戳、更新一次状态
 bool ModbusRS485::update(){
-  while(available()){
-    uint8_t d = read();
-    if(debugReadPrint && debugStream){
-      debugStream->print("[");
-      debugStream->print(micros());
-      debugStream->print("]");
-      debugStream->println(d);
+  while(true){
+    int incoming = transport->available();
+    if(incoming <= 0) break;
+    if(state == ModbusRS485::WaitStation){  //新的一帧
+      received = 0;
+      rxCRC = ModbusCRC::Init;
+    }
+    uint16_t length = sizeof(rxFrame.buffer) - received;
+    if((uint16_t)incoming < length) length = incoming;
+    if(earlyFrameCompletion){  //不越过预测的帧尾, 剩余字节属于下一帧
+      uint16_t limit = getReadLimit();
+      if(limit - received < length) length = limit - received;
     }
-    switch(state){
-      case ModbusRS485::WaitStation:  //Waiting Station
-        state = ModbusRS485::WaitFunctionCode; //Wait Function Code
-        received = 0; //Reset Length
-        rxFrame.buffer[received++] = d;  //Push Station into rxBuffer
-      break;
-      case ModbusRS485::WaitFunctionCode: //Waiting Function Code
-        state = ModbusRS485::WaitData;
-        rxFrame.buffer[received++] = d;  //Push Function Code into rxBuffer
-      break;
-      case ModbusRS485::WaitData:
-        rxFrame.buffer[received++] = d;  //Push Data into rxBuffer
-      break;
+    uint16_t n = (uint16_t)transport->readBytes(rxFrame.buffer + received, length);
+    if(n == 0) break;
+    if(debugReadPrint && debugStream){
+      for(uint16_t i=0; i<n; i++){
+        debugStream->print("[");
+        debugStream->print(getMicros());
+        debugStream->print("]");
+        debugStream->println(rxFrame.buffer[received+i]);
+      }
     }
-    lastTick = micros();
-    if(received >= 384) return 0;
+    if(incrementalCRC) rxCRC = ModbusCRC::update(rxCRC, rxFrame.buffer + received, n);
+    received += n;
+    state = received >= 2 ? ModbusRS485::WaitData : ModbusRS485::WaitFunctionCode;
+    lastTick = transport->receiveMicros();
+    if(received >= sizeof(rxFrame.buffer)) return 0;
+    if(earlyFrameCompletion && received == getExpectedFrameLength()) break; //帧长已收齐, 剩余字节属于下一帧
   }
   return 1;
 }
 
 void ModbusRS485::setStopDelay(uint32_t argStopDelay){
+#if MODBUS_USE_RS485
   setDelay(0, argStopDelay);
+#else
+  stopDelay = argStopDelay;
+#endif
   if(timeOut <= argStopDelay){
     setReceiveTimeOut(argStopDelay); //Make sure timeout is larger than stopDelay
   }
 }
+void ModbusRS485::beginTiming(size_t baud, uint32_t config){
+  serialConfig = config;
+  serialBaudrate = baud;
+  setStopDelay(ceil(3.5*1000000.0*getSerialFrameLength()/serialBaudrate));
+  sendBackDelay = (uint32_t)(stopDelay*sendBackDelayRatio);
+}
+
 void ModbusRS485::setReceiveTimeOut(uint32_t argTime){
   timeOut = argTime;
+  transport->setFrameTimeout(argTime);
 }
 
 void ModbusRS485::printFailType(Stream& stream){
@@ -102,8 +126,46 @@ void ModbusRS485::clearStatics(){
 }
 
 /*Modbus Master*/
+#if MODBUS_USE_RS485
 ModbusRS485Master::ModbusRS485Master(HardwareSerial& serial, CRC16 *modbusCRC) : ModbusRS485(serial,modbusCRC){
+  initMaster();
+}
+#else
+ModbusRS485Master::ModbusRS485Master(ModbusTransport& argTransport, CRC16 *modbusCRC) : ModbusRS485(argTransport,modbusCRC){
+  initMaster();
+}
+#endif
+
+void ModbusRS485Master::initMaster(){
   waitSlavePackTimedout = 100*1000;
+  waitSlavePackTick = 0;
+  waitSlaveResponse = false;
+  transmitOnUpdateFlag = false;
+  transmitTargetStation = 0;
+  pollJobs = 0;
+  pollJobCount = 0;
+  activeJob = 0;
+  waitStation = 0;
+  waitTimeout = waitSlavePackTimedout;
+  responseStarted = false;
+  responseStartTick = 0;
+  stationLinks = 0;
+  stationLinkCount = 0;
+  responseTimeoutFloor = 0;
+  responseTimeoutCeiling = 0;
+  maxRetries = 0;
+  retriesLeft = 0;
+  retryPending = false;
+  retryFailType = ModbusRS485::RcvNoFail;
+  txLength = 0;
+  retryPacks = 0;
+  breakerThreshold = 0;
+  breakerBaseBackoff = 0;
+  breakerMaxBackoff = 0;
+  broadcastTurnaround = 100*1000;
+  turnaroundTick = 0;
+  turnaroundPending = false;
+  rxIsResponse = true;
 }
 
 void ModbusRS485Master::processPack(){
@@ -121,16 +183,42 @@ void ModbusRS485Master::processPack(){
 }
 
 void ModbusRS485Master::onGetPack(){
+  bool waiting = waitSlaveResponse;
   waitSlaveResponse = false;  //结束等待从机返回
+  bool sampled = responseStarted;
+  responseStarted = false;
+  if(waiting){  //回调里可能发出下一个请求, 先记录本次的结果
+    bool valid = isResponseValid();
+    if(!valid && retryOnFailure()) return;  //重试中, 不通知上层
+    if(!valid && failType == ModbusRS485::RcvNoFail){  //CRC错误或站号不对, 上层和finishPollJob按失败处理
+      failType = ModbusRS485::RcvVerifyFailed;
+      rxFailPacks ++;
+    }
+    recordStationResult(waitStation, valid);
+    if(valid && sampled) updateStationLink(waitStation, responseStartTick - waitSlavePackTick);
+  }
   if(onReceived) onReceived(this);
+  finishPollJob();
+}
+
+//是所等站号的回复且CRC正确(异常回复也算, 说明从站在线)
+bool ModbusRS485Master::isResponseValid(){
+  if(failType != ModbusRS485::RcvNoFail || rxFrame.getStation() != waitStation) return false;
+  return incrementalCRC ? rxCRC == 0 : rxFrame.calcCRC(rxFrame.validDataLength) == 0;
+}
+
+bool ModbusRS485Master::retryOnFailure(){
+  if(retriesLeft == 0) return false;
+  retriesLeft --;
+  retryPending = true;
+  retryFailType = failType;  //接收状态随后会被clear, 放弃重试时还要用这次的结果
+  return true;
 }
 
+#if MODBUS_USE_RS485
 void ModbusRS485Master::begin(size_t baud, uint32_t config, int16_t rxPin, int16_t txPin, int16_t dePin, int16_t rePin, bool readBack){
   RS485::begin(baud,config,rxPin,txPin,dePin,rePin,readBack);
-  serialConfig = config;
-  serialBaudrate = baud;
-  setStopDelay(ceil(3.5*1000000.0*getSerialFrameLength()/serialBaudrate));
-  sendBackDelay = (uint32_t)(stopDelay*sendBackDelayRatio);
+  beginTiming(baud, config);
 }
 
 void ModbusRS485Master::begin(size_t baud, uint32_t config, int16_t rxPin, int16_t txPin, int16_t dePin, int16_t rePin, bool readBack, uint32_t pWaitSlaveTimedoutUs){
@@ -140,24 +228,33 @@ void ModbusRS485Master::begin(size_t baud, uint32_t config, int16_t rxPin, int16
 
 void ModbusRS485Master::begin(RS485Config conf){
   RS485::begin(conf);
-  serialConfig = conf.config;
-  serialBaudrate = conf.baudrate;
-  setStopDelay(ceil(3.5*1000000.0*getSerialFrameLength()/serialBaudrate));
-  sendBackDelay = (uint32_t)(stopDelay*sendBackDelayRatio);
+  beginTiming(conf.baudrate, conf.config);
 }
 
 void ModbusRS485Master::begin(RS485Config conf,uint32_t pWaitSlaveTimedoutUs){
   begin(conf);
   waitSlavePackTimedout = pWaitSlaveTimedoutUs;
 }
+#else
+void ModbusRS485Master::begin(size_t baud, uint32_t config){
+  transport->begin(baud, config);
+  beginTiming(baud, config);
+}
 
-void ModbusRS485Master::update(){
-  if(transmitOnUpdateFlag && isSendBackDelayComplete()){
+void ModbusRS485Master::begin(size_t baud, uint32_t config, uint32_t pWaitSlaveTimedoutUs){
+  begin(baud, config);
+  waitSlavePackTimedout = pWaitSlaveTimedoutUs;
+}
+#endif
+
+uint32_t ModbusRS485Master::update(){
+  if(!isInTurnaround(getMicros()) && transmitOnUpdateFlag && isSendBackDelayComplete()){  //每次都检查, 转换延时到期后及时清除
+    if(retryPending) abandonRetry();  //txFrame已换成新的请求, 等待中的重试发不出去了
     transmit(transmitTargetStation);
     transmitTargetStation = 0;
     transmitOnUpdateFlag = false;
   }
-  uint8_t incoming = available();
+  uint8_t incoming = transport->available() > 0;
   if(state != ModbusRS485::WaitStation && !incoming && isTimedout()){
     if(received >= 4){
       rxFrame.validDataLength = received;
@@ -170,15 +267,20 @@ void ModbusRS485Master::update(){
     }
     clear();
   }
-  if(waitSlaveResponse){
+  if(waitSlaveResponse && !responseStarted){
     /*Serial.println("----");
     Serial.println(micros());
     Serial.println(micros()-waitSlavePackTick);
     Serial.println(waitSlavePackTimedout);*/
-    if(micros()-waitSlavePackTick > waitSlavePackTimedout){ //超时
+    if(getMicros()-waitSlavePackTick > waitTimeout){ //超时
       setReceiveWaitTimedout();
-      if(onReceived) onReceived(this);
+      backoffStationLink(waitStation);
       waitSlaveResponse = false;  //结束等待从机返回
+      if(!retryOnFailure()){
+        recordStationResult(waitStation, false);
+        if(onReceived) onReceived(this);
+        finishPollJob();
+      }
       clear();
     }
   }
@@ -189,48 +291,316 @@ void ModbusRS485Master::update(){
     onGetPack();
     clear();
   }
+  if(waitSlaveResponse && !responseStarted && state != ModbusRS485::WaitStation){ //回复开始到达, 记下延时
+    responseStarted = true;
+    responseStartTick = lastTick;
+  }
+  if(isFrameCompleteEarly()){ //帧已收齐且CRC正确, 不再等待t3.5
+    rxFrame.validDataLength = received;
+    onGetPack();
+    clear();
+  }
+  if(retryPending) dispatchRetry();
+  if(pollJobs) dispatchPollJob();
+  return getTimeToDeadline();
+}
+
+uint32_t ModbusRS485Master::getTimeToDeadline(){
+  if(transport->available() > 0) return 0;
+  uint32_t now = getMicros();
+  uint32_t remaining = getFrameGapRemaining(now);
+  if(transmitOnUpdateFlag){  //转换延时内update()不会发送, 取两者中较晚的
+    uint32_t sendAt = getRemaining(now, sendBackStartTick, sendBackDelay);
+    if(isInTurnaround(now)){
+      uint32_t turnaround = getRemaining(now, turnaroundTick, broadcastTurnaround);
+      if(turnaround > sendAt) sendAt = turnaround;
+    }
+    remaining = nearer(remaining, sendAt);
+  }
+  if(waitSlaveResponse){
+    if(!responseStarted) remaining = nearer(remaining, getRemaining(now, waitSlavePackTick, waitTimeout));
+  }else if(isInTurnaround(now)) remaining = nearer(remaining, getRemaining(now, turnaroundTick, broadcastTurnaround));
+  else if(retryPending) remaining = nearer(remaining, getRemaining(now, lastTick, timeOut));
+  else if(pollJobs) remaining = nearer(remaining, getTimeToNextPollJob(now));
+  return remaining;
+}
+
+bool ModbusRS485Master::wait(uint32_t maxWaitUs){
+  return waitFor(nearer(getTimeToDeadline(), maxWaitUs));
 }
 
 bool ModbusRS485Master::availableToTransmit(){
-  if(waitSlaveResponse && (micros()-waitSlavePackTick <= waitSlavePackTimedout)) //如果是主机正在等待从机回复且没有超时
+  if(waitSlaveResponse && (responseStarted || getMicros()-waitSlavePackTick <= waitTimeout)) //如果是主机正在等待从机回复且没有超时
     return false; //返回不能发送
+  if(retryPending) return false;  //重试还没发出, 上一个请求还没有结果
+  if(isInTurnaround(getMicros())) return false;  //广播后的转换延时
   return true;
 }
 
 void ModbusRS485Master::transmitOnUpdate(uint8_t targetStation){
   transmitTargetStation = targetStation;
   transmitOnUpdateFlag = true;
-  sendBackStartTick = micros();
+  sendBackStartTick = getMicros();
 }
 
 bool ModbusRS485Master::transmit(uint8_t targetStation){
   //if(!availableToTransmit()) return false;
-  beginTransmission();
+  if(!canTransmit(targetStation, txFrame.getFunctionCode())) return false;
+  activeJob = 0;
+  transport->beginTransmission();
   *(txFrame.station) = targetStation; //设置地址
   transmitFrame();
-  endTransmission();
+  transport->endTransmission();
   txPacks++; // 增加发送包计数
-  waitSlavePackTick = micros();
-  waitSlaveResponse = true;
+  txLength = txFrame.getFrameLength();
+  beginTransaction(targetStation);
   return true;
 }
 
 bool ModbusRS485Master::transmitRaw(uint8_t targetStation, uint16_t length){
   //if(!availableToTransmit()) return false;
-  beginTransmission();
+  if(!canTransmit(targetStation, txFrame.getFunctionCode())) return false;
+  activeJob = 0;
+  transport->beginTransmission();
   *(txFrame.station) = targetStation; //设置地址
   transmitFrameRaw(length);
-  endTransmission();
+  transport->endTransmission();
   txPacks++; // 增加发送包计数
-  waitSlavePackTick = micros();
+  txLength = length;
+  beginTransaction(targetStation);
+  return true;
+}
+
+//转换延时未过、重试未发出、广播了不允许广播的功能码或断路器断开时不能发送
+bool ModbusRS485Master::canTransmit(uint8_t targetStation, uint8_t functionCode){
+  if(isInTurnaround(getMicros()) || retryPending) return false;
+  if(targetStation == BroadcastStation) return isBroadcastFunctionCode(functionCode);
+  return isStationAvailable(targetStation);
+}
+
+//广播不等待回复, 只开始转换延时; 探测请求不重试, 失败就继续退避
+void ModbusRS485Master::beginTransaction(uint8_t targetStation){
+  if(targetStation == BroadcastStation){
+    waitSlaveResponse = false;
+    responseStarted = false;
+    retryPending = false;
+    turnaroundPending = true;
+    turnaroundTick = getMicros();
+    return;
+  }
+  turnaroundPending = false;
+  ModbusStationLink *link = getStationLink(targetStation);
+  retriesLeft = (link && link->backoff) ? 0 : maxRetries;
+  retryPending = false;
+  beginWaitResponse(targetStation);
+}
+
+//txFrame中还是上一个请求(含CRC), 帧间隔过后原样重发
+void ModbusRS485Master::dispatchRetry(){
+  if(waitSlaveResponse || transmitOnUpdateFlag || state != ModbusRS485::WaitStation) return;
+  if(getMicros() - lastTick <= timeOut) return;
+  retryPending = false;
+  transport->beginTransmission();
+  transmitFrameRaw(txLength);
+  transport->endTransmission();
+  txPacks++;
+  retryPacks++;
+  beginWaitResponse(waitStation);
+}
+
+//放弃等待中的重试, 原来的请求按失败结束, 和重试用完时一样通知上层
+void ModbusRS485Master::abandonRetry(){
+  retryPending = false;
+  failType = retryFailType;
+  if(failType == ModbusRS485::RcvNoFail){  //CRC错误或站号不对的回复
+    failType = ModbusRS485::RcvVerifyFailed;
+    rxFailPacks ++;
+  }
+  recordStationResult(waitStation, false);
+  if(onReceived) onReceived(this);
+  finishPollJob();
+  failType = ModbusRS485::RcvNoFail;  //不影响下一个请求回复的校验
+}
+
+void ModbusRS485Master::beginWaitResponse(uint8_t targetStation){
+  waitSlavePackTick = getMicros();
   waitSlaveResponse = true;
+  waitStation = targetStation;
+  waitTimeout = getResponseTimeout(targetStation);
+  responseStarted = false;
+}
+
+bool ModbusRS485Master::setStationLinks(ModbusStationLink *links, uint16_t count, uint32_t floorUs, uint32_t ceilingUs){
+  if(links == 0 || count == 0 || count > 256 || floorUs > ceilingUs) return false;
+  for(uint16_t i=0; i<count; i++) links[i].clear(ceilingUs);  //还没有测量时按上限等待
+  stationLinks = links;
+  stationLinkCount = count;
+  responseTimeoutFloor = floorUs;
+  responseTimeoutCeiling = ceilingUs;
+  return true;
+}
+
+uint32_t ModbusRS485Master::getResponseTimeout(uint8_t st){
+  ModbusStationLink *link = getStationLink(st);
+  return link ? link->timeout : waitSlavePackTimedout;
+}
+
+//RFC 6298: RTTVAR = 3/4*RTTVAR + 1/4*|SRTT-R|, SRTT = 7/8*SRTT + 1/8*R, 超时 = SRTT + 4*RTTVAR
+void ModbusRS485Master::updateStationLink(uint8_t st, uint32_t rtt){
+  ModbusStationLink *link = getStationLink(st);
+  if(link == 0) return;
+  if(link->samples == 0){
+    link->srtt = rtt;
+    link->rttvar = rtt / 2;
+  }else{
+    uint32_t delta = link->srtt > rtt ? link->srtt - rtt : rtt - link->srtt;
+    link->rttvar = link->rttvar - link->rttvar / 4 + delta / 4;
+    link->srtt = link->srtt - link->srtt / 8 + rtt / 8;
+  }
+  link->samples ++;
+  uint64_t timeout = (uint64_t)link->srtt + 4 * (uint64_t)link->rttvar;
+  if(timeout < responseTimeoutFloor) timeout = responseTimeoutFloor;
+  if(timeout > responseTimeoutCeiling) timeout = responseTimeoutCeiling;
+  link->timeout = (uint32_t)timeout;
+}
+
+//超时后加倍, 从站变慢时不会一直用过紧的超时错过回复, 下一次成功测量后重新计算
+void ModbusRS485Master::backoffStationLink(uint8_t st){
+  ModbusStationLink *link = getStationLink(st);
+  if(link == 0) return;
+  uint64_t timeout = (uint64_t)link->timeout * 2;
+  link->timeout = timeout > responseTimeoutCeiling ? responseTimeoutCeiling : (uint32_t)timeout;
+}
+
+void ModbusRS485Master::setCircuitBreaker(uint8_t threshold, uint32_t baseUs, uint32_t maxUs){
+  breakerThreshold = threshold;
+  breakerBaseBackoff = baseUs ? baseUs : 1;
+  breakerMaxBackoff = maxUs < breakerBaseBackoff ? breakerBaseBackoff : maxUs;
+  for(uint16_t i=0; i<stationLinkCount; i++){
+    stationLinks[i].failures = 0;
+    stationLinks[i].backoff = 0;
+    stationLinks[i].probeDue = false;
+  }
+}
+
+bool ModbusRS485Master::isStationAvailable(uint8_t st){
+  return !isStationOpen(st, getMicros());
+}
+
+//一个请求(含重试)的最终结果: 成功则闭合, 断开后探测失败则退避加倍
+void ModbusRS485Master::recordStationResult(uint8_t st, bool success){
+  ModbusStationLink *link = getStationLink(st);
+  if(link == 0 || breakerThreshold == 0) return;
+  if(success){
+    link->failures = 0;
+    link->backoff = 0;
+    link->probeDue = false;
+    return;
+  }
+  if(link->failures < 0xFF) link->failures ++;
+  if(link->backoff){
+    uint64_t backoff = (uint64_t)link->backoff * 2;
+    link->backoff = backoff > breakerMaxBackoff ? breakerMaxBackoff : (uint32_t)backoff;
+  }else if(link->failures >= breakerThreshold){
+    link->backoff = breakerBaseBackoff;
+    link->trips ++;
+  }else{
+    return;
+  }
+  link->probeAt = getMicros() + link->backoff;
+  link->probeDue = false;
+}
+
+//相同周期的任务按序号均匀错开起始时间, 避免慢速点挤在同一时刻
+bool ModbusRS485Master::setPollJobs(ModbusPollJob *jobs, uint16_t count){
+  if(jobs == 0 || count == 0) return false;
+  for(uint16_t i=0; i<count; i++){
+    if(jobs[i].functionCode < 0x01 || jobs[i].functionCode > 0x04 || jobs[i].periodUs == 0) return false;
+    if(!isStationValid(jobs[i].station)) return false;  //读请求不能广播
+  }
+  uint32_t now = getMicros();
+  for(uint16_t i=0; i<count; i++){
+    uint16_t samePeriod = 0, order = 0;
+    for(uint16_t k=0; k<count; k++){
+      if(jobs[k].periodUs != jobs[i].periodUs) continue;
+      if(k < i) order ++;
+      samePeriod ++;
+    }
+    jobs[i].nextDue = now + (uint32_t)((uint64_t)jobs[i].periodUs * order / samePeriod);
+  }
+  pollJobs = jobs;
+  pollJobCount = count;
+  activeJob = 0;
   return true;
 }
 
+void ModbusRS485Master::finishPollJob(){
+  if(activeJob == 0) return;
+  if(failType == ModbusRS485::RcvNoFail) activeJob->polls ++;
+  else activeJob->failures ++;
+  activeJob = 0;
+}
 
+//优先级高的先发, 同优先级按到期时间(最早截止优先)
+void ModbusRS485Master::dispatchPollJob(){
+  if(waitSlaveResponse || retryPending || transmitOnUpdateFlag || state != ModbusRS485::WaitStation) return;
+  uint32_t now = getMicros();
+  if(now - lastTick <= timeOut || isInTurnaround(now)) return;  //上一帧之后至少间隔t3.5
+  ModbusPollJob *best = 0;
+  for(uint16_t i=0; i<pollJobCount; i++){
+    ModbusPollJob *job = &pollJobs[i];
+    if(!job->enabled || (int32_t)(now - job->nextDue) < 0 || isStationOpen(job->station, now)) continue;
+    if(best == 0 || job->priority < best->priority
+      || (job->priority == best->priority && (int32_t)(job->nextDue - best->nextDue) < 0)) best = job;
+  }
+  if(best == 0) return;
+  uint32_t late = now - best->nextDue;
+  if(late >= best->periodUs){  //错过了整周期, 保持相位跳到下一个周期
+    uint32_t missed = late / best->periodUs;
+    best->missedDeadlines += missed;
+    best->nextDue += missed * best->periodUs;
+  }
+  best->nextDue += best->periodUs;
+  txFrame.createRequest(best->functionCode);
+  MBVReadHoldingRegisterRequest request = txFrame.view<MBVReadHoldingRegisterRequest>();  //0x01~0x04请求布局相同
+  request.setStartAddress(best->startAddress);
+  request.setQuantity(best->quantity);
+  transmit(best->station);
+  activeJob = best;
+}
+
+uint32_t ModbusRS485Master::getTimeToNextPollJob(uint32_t now){
+  uint32_t remaining = NoDeadline;
+  for(uint16_t i=0; i<pollJobCount; i++){
+    if(!pollJobs[i].enabled) continue;
+    uint32_t due = pollJobs[i].nextDue;
+    if(isStationOpen(pollJobs[i].station, now)) due = getStationLink(pollJobs[i].station)->probeAt;  //断开的站等到可以探测
+    int32_t diff = (int32_t)(due - now);
+    remaining = nearer(remaining, diff <= 0 ? 0 : (uint32_t)diff);
+  }
+  if(remaining != NoDeadline){  //总线上一帧之后还要留出t3.5
+    uint32_t gap = getRemaining(now, lastTick, timeOut);
+    if(gap > remaining) remaining = gap;
+  }
+  return remaining;
+}
 
 /*Modbus Slave*/
-ModbusRS485Slave::ModbusRS485Slave(HardwareSerial& serial, CRC16 *modbusCRC) : ModbusRS485(serial, modbusCRC){}
+#if MODBUS_USE_RS485
+ModbusRS485Slave::ModbusRS485Slave(HardwareSerial& serial, CRC16 *modbusCRC) : ModbusRS485(serial, modbusCRC){
+  transmitOnUpdateFlag = false;
+  isAllowedToTransmit = false;
+  broadcastRequest = false;
+  station = 0;
+}
+#else
+ModbusRS485Slave::ModbusRS485Slave(ModbusTransport& argTransport, CRC16 *modbusCRC) : ModbusRS485(argTransport, modbusCRC){
+  transmitOnUpdateFlag = false;
+  isAllowedToTransmit = false;
+  broadcastRequest = false;
+  station = 0;
+}
+#endif
 
 void ModbusRS485Slave::processPack(){
   if(rxFrame.castRequest()){
@@ -243,29 +613,32 @@ void ModbusRS485Slave::processPack(){
 }
 
 void ModbusRS485Slave::onGetPack(){
-  isAllowedToTransmit = true;  //允许回复数据
+  broadcastRequest = isBroadcast();
+  isAllowedToTransmit = !broadcastRequest;  //允许回复数据, 广播不回复
   if(onReceived) onReceived(this);
 }
 
+#if MODBUS_USE_RS485
 void ModbusRS485Slave::begin(uint8_t pStation, size_t baud, uint32_t config, int16_t rxPin, int16_t txPin, int16_t dePin, int16_t rePin, bool readBack){
   RS485::begin(baud,config,rxPin,txPin,dePin,rePin,readBack);
   station = pStation;
-  serialConfig = config;
-  serialBaudrate = baud;
-  setStopDelay(ceil(3.5*1000000.0*getSerialFrameLength()/serialBaudrate));
-  sendBackDelay = (uint32_t)(stopDelay*sendBackDelayRatio);
+  beginTiming(baud, config);
 }
 
 void ModbusRS485Slave::begin(uint8_t pStation,RS485Config conf){
   RS485::begin(conf);
   station = pStation;
-  serialConfig = conf.config;
-  serialBaudrate = conf.baudrate;
-  setStopDelay(ceil(3.5*1000000.0*getSerialFrameLength()/serialBaudrate));
-  sendBackDelay = (uint32_t)(stopDelay*sendBackDelayRatio);
+  beginTiming(conf.baudrate, conf.config);
 }
+#else
+void ModbusRS485Slave::begin(uint8_t pStation, size_t baud, uint32_t config){
+  transport->begin(baud, config);
+  station = pStation;
+  beginTiming(baud, config);
+}
+#endif
 
-void ModbusRS485Slave::update(){
+uint32_t ModbusRS485Slave::update(){
   if(transmitOnUpdateFlag && isSendBackDelayComplete()){
     //Serial.println("Send on update");
     if(availableToTransmit()){
@@ -273,13 +646,13 @@ void ModbusRS485Slave::update(){
     }
     transmitOnUpdateFlag = false;
   }
-  uint8_t incoming = available();
+  uint8_t incoming = transport->available() > 0;
   if(state != ModbusRS485::WaitStation && !incoming && isTimedout()){
     if(debugReadPrint && debugStream){
       debugStream->println("------");
-      debugStream->println(micros());
+      debugStream->println(getMicros());
       debugStream->println(lastTick);
-      debugStream->println(micros()-lastTick);
+      debugStream->println(getMicros()-lastTick);
       debugStream->println(stopDelay*1000);
       debugStream->println("------");
     }
@@ -299,6 +672,24 @@ void ModbusRS485Slave::update(){
     onGetPack();
     clear();
   }
+  if(isFrameCompleteEarly()){ //帧已收齐且CRC正确, 不再等待t3.5
+    rxFrame.validDataLength = received;
+    onGetPack();
+    clear();
+  }
+  return getTimeToDeadline();
+}
+
+uint32_t ModbusRS485Slave::getTimeToDeadline(){
+  if(transport->available() > 0) return 0;
+  uint32_t now = getMicros();
+  uint32_t remaining = getFrameGapRemaining(now);
+  if(transmitOnUpdateFlag) remaining = nearer(remaining, getRemaining(now, sendBackStartTick, sendBackDelay));
+  return remaining;
+}
+
+bool ModbusRS485Slave::wait(uint32_t maxWaitUs){
+  return waitFor(nearer(getTimeToDeadline(), maxWaitUs));
 }
 
 bool ModbusRS485Slave::availableToTransmit(){
@@ -311,10 +702,11 @@ void ModbusRS485Slave::transmitOnUpdate(){
 
 bool ModbusRS485Slave::transmit(){
   //if(!availableToTransmit()) return false;
-  beginTransmission();
+  if(broadcastRequest) return false;  //广播请求只执行不回复
+  transport->beginTransmission();
   *(txFrame.station) = station; //设置地址
   transmitFrame();
-  endTransmission();
+  transport->endTransmission();
   txPacks++; // 增加发送包计数
   isAllowedToTransmit = false;
   return true;
@@ -322,9 +714,9 @@ bool ModbusRS485Slave::transmit(){
 
 bool ModbusRS485Slave::transmitRaw(uint16_t length){
   //if(!availableToTransmit()) return false;
-  beginTransmission();
+  transport->beginTransmission();
   transmitFrameRaw(length);
-  endTransmission();
+  transport->endTransmission();
   txPacks++; // 增加发送包计数
   isAllowedToTransmit = false;
   return true;
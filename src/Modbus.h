@@ -1,13 +1,52 @@
 #pragma once
+#include "ModbusPack.h"
+#include "ModbusTransport.h"
+
+//是否基于RS485库(Arduino): 找得到RS485.h时默认使用, 否则ModbusRS485只能通过ModbusTransport构造
+#ifndef MODBUS_USE_RS485
+  #if defined(__has_include)
+    #if __has_include("RS485.h")
+      #define MODBUS_USE_RS485 1
+    #else
+      #define MODBUS_USE_RS485 0
+    #endif
+  #else
+    #define MODBUS_USE_RS485 1
+  #endif
+#endif
+
+#if MODBUS_USE_RS485
 #include "HardwareSerial.h"
 #include "RS485.h"
-#include "ModbusPack.h"
+
+//RS485库到ModbusTransport的适配
+class ModbusRS485Transport : public ModbusTransport{
+public:
+  explicit ModbusRS485Transport(RS485 &bus) : rs485(bus) {}
+  int available(){ return rs485.available(); }
+  size_t readBytes(uint8_t *data, size_t length){
+    size_t n = 0;
+    while(n < length && rs485.available() > 0) data[n++] = (uint8_t)rs485.read();
+    return n;
+  }
+  size_t writeBytes(const uint8_t *data, size_t length){ return rs485.write(data, length); }
+  void beginTransmission(){ rs485.beginTransmission(); }
+  void endTransmission(){ rs485.endTransmission(); }
+  uint32_t micros(){ return ::micros(); }
+private:
+  RS485 &rs485;
+};
+#endif
 
 class ModbusRS485;
 typedef void(*ModbusCallbackOnReceived)(ModbusRS485 *modbusController);
 
 //ModbusRS485基类
+#if MODBUS_USE_RS485
 class ModbusRS485 : public RS485{
+#else
+class ModbusRS485{
+#endif
 public:
   constexpr static uint8_t WaitStation = 0x00;
   constexpr static uint8_t WaitFunctionCode = 0x01;
@@ -18,8 +57,11 @@ public:
   constexpr static uint8_t RcvVerifyFailed = 0x02;
   constexpr static uint8_t RcvOverflow = 0x03;
   constexpr static uint8_t RcvUnsupportedFunctionCode = 0x04;
+  constexpr static uint32_t NoDeadline = 0xFFFFFFFF;  //update()返回: 没有待处理的期限
+  constexpr static uint8_t BroadcastStation = 0x00;  //广播地址, 所有从站执行且不回复
   
   ModbusCallbackOnReceived onReceived;
+  void *userData;  //回调中找回上层对象(例如网关)
   uint32_t timeOut; //Pack Receive Timeout
   uint32_t sendBackStartTick;
   uint32_t sendBackDelay;
@@ -37,11 +79,22 @@ public:
   uint32_t serialBaudrate;
 
   bool debugReadPrint;
+  bool incrementalCRC;  //接收时逐字节累加CRC, 静默间隔到达时帧已完成校验
+  uint16_t rxCRC;       //当前帧(含CRC字节)的累加CRC, 完整帧为0
+  bool earlyFrameCompletion;  //按功能码预测帧长, 收齐且CRC正确时立即完成, 不等待t3.5
+  ModbusWriteHook transmitHook;  //设置后整帧通过钩子一次发出(writev/DMA), 否则一次Stream::write
+  void *transmitHookContext;
 
   ModbusFrame txFrame;
   ModbusFrame rxFrame;
 
+#if MODBUS_USE_RS485
   ModbusRS485(HardwareSerial& serial, CRC16 *modbusCRC = 0);
+#else
+  uint32_t stopDelay;
+  Stream *debugStream;
+  ModbusRS485(ModbusTransport& argTransport, CRC16 *modbusCRC = 0);
+#endif
   bool update();
   void clear();
   inline void setSendBackDelayRatio(float ratio){ sendBackDelayRatio = ratio; }
@@ -53,25 +106,74 @@ public:
   uint8_t getSerialFrameLength();
 
   inline bool isStationValid(uint8_t st){ return st >= 1 && st <= 247; }
+  //允许广播的功能码: 写单个/多个线圈、写单个/多个保持寄存器
+  static inline bool isBroadcastFunctionCode(uint8_t fc){ return fc == 0x05 || fc == 0x06 || fc == 0x0F || fc == 0x10; }
   
   inline void setDebugReadPrintEnabled(bool argDebugReadPrint){ debugReadPrint = argDebugReadPrint; }
   inline bool isDebugReadPrintEnabled(){ return debugReadPrint; }
+  inline void setIncrementalCRCEnabled(bool enabled){ incrementalCRC = enabled; }
+  inline bool isIncrementalCRCEnabled(){ return incrementalCRC; }
+  inline void setEarlyFrameCompletionEnabled(bool enabled){ earlyFrameCompletion = enabled; }
+  inline bool isEarlyFrameCompletionEnabled(){ return earlyFrameCompletion; }
+  inline void setTransmitHook(ModbusWriteHook hook, void *context = 0){ transmitHook = hook; transmitHookContext = context; }
+  inline ModbusTransport *getTransport(){ return transport; }
+  inline int getPollFd(){ return transport->getPollFd(); }  //数据到达或帧间隔到期时可读, 不支持时为-1
+#if MODBUS_USE_RS485
+  inline void setTransport(ModbusTransport *argTransport){  //传0恢复使用RS485
+    transport = argTransport ? argTransport : &rs485Transport;
+    transport->setFrameTimeout(timeOut);
+  }
+#endif
   // 获取计数器的函数
   inline uint32_t getTxPacks(){ return txPacks; }
   inline uint32_t getRxPacks(){ return rxPacks; }
   inline uint32_t getRxFailPacks(){ return rxFailPacks; }
 protected:
+  ModbusTransport *transport;
+#if MODBUS_USE_RS485
+  ModbusRS485Transport rs485Transport;
+#endif
+  bool rxIsResponse;  //主站接收的是回复, 从站接收的是请求, 用于预测帧长
+
+  void init();
+  void beginTiming(size_t baud, uint32_t config);  //按波特率和帧格式计算t3.5和回复延时
+  inline uint32_t getMicros(){ return transport->micros(); }
+
+  inline uint16_t getExpectedFrameLength(){
+    return rxIsResponse ? rxFrame.expectedResponseLength(received) : rxFrame.expectedRequestLength(received);
+  }
+  //提前完成帧时本次最多读到哪里: 帧长已知时到帧尾, 未知时只读到下一个能确定帧长的位置(功能码、字节数)
+  inline uint16_t getReadLimit(){
+    uint16_t expected = getExpectedFrameLength();
+    if(expected > received) return expected;
+    if(expected == 0){
+      if(received < 2) return 2;
+      if(received < 3) return 3;
+      if(received < 7) return 7;
+      if(received < 11) return 11;
+    }
+    return sizeof(rxFrame.buffer);
+  }
+  inline bool isFrameCompleteEarly(){
+    if(!earlyFrameCompletion || state == WaitStation) return false;
+    uint16_t expected = getExpectedFrameLength();
+    if(expected == 0 || received != expected) return false;
+    return incrementalCRC ? rxCRC == 0 : rxFrame.calcCRC(received) == 0; //CRC不对则回退到静默超时
+  }
   inline void transmitFrame(){
     applyTxFrameCRC();
-    txFrame.write(*this);
+    if(transmitHook) txFrame.write(transmitHook, transmitHookContext);
+    else txFrame.write(ModbusTransport::writeHook, transport);
   }
 
   inline void transmitFrameRaw(uint16_t length){
-    txFrame.writeRaw(*this,length);
+    if(transmitHook) txFrame.writeRaw(transmitHook, transmitHookContext, length);
+    else txFrame.writeRaw(ModbusTransport::writeHook, transport, length);
   }
   
   inline void verifyRxFrameCRC(){
-    if(!rxFrame.verifyCRC()){
+    bool verified = incrementalCRC ? rxFrame.verifyCRC(rxCRC) : rxFrame.verifyCRC();
+    if(!verified){
       failType = RcvVerifyFailed;
     }
   }
@@ -83,11 +185,24 @@ protected:
   }
   inline bool isTimedout(){
     if(state == WaitStation) return false;
-    if(micros()-lastTick > timeOut) return true;
+    if(getMicros()-lastTick > timeOut) return true;
     return false;
   }
+  //从start开始经过delay之后(严格大于)还剩多少微秒, 和isTimedout等判断保持一致
+  static inline uint32_t getRemaining(uint32_t now, uint32_t start, uint32_t delay){
+    uint32_t elapsed = now - start;
+    return elapsed > delay ? 0 : delay - elapsed + 1;
+  }
+  static inline uint32_t nearer(uint32_t a, uint32_t b){ return a < b ? a : b; }
+  inline uint32_t getFrameGapRemaining(uint32_t now){
+    if(state == WaitStation) return NoDeadline;
+    return getRemaining(now, lastTick, timeOut);
+  }
+  inline bool waitFor(uint32_t us){
+    return transport->wait(us == NoDeadline ? ModbusTransport::WaitForever : us);
+  }
   inline bool isSendBackDelayComplete(){
-    if(micros()-sendBackStartTick > sendBackDelay)
+    if(getMicros()-sendBackStartTick > sendBackDelay)
       return true;
     else
       return false;
@@ -98,34 +213,177 @@ protected:
   }
 };
 
+//主站周期轮询任务, 由用户提供的数组保存
+class ModbusPollJob{
+public:
+  uint8_t station;
+  uint8_t functionCode;  //0x01~0x04
+  uint16_t startAddress;
+  uint16_t quantity;
+  uint32_t periodUs;
+  uint8_t priority;      //数值越小越优先, 同一优先级内先到期的先发
+  bool enabled;
+  void *userData;
+  //调度状态和统计
+  uint32_t nextDue;
+  uint32_t polls;
+  uint32_t failures;
+  uint32_t missedDeadlines;  //整个周期都没能发出而跳过的次数
+
+  inline void set(uint8_t argStation, uint8_t argFunctionCode, uint16_t argStartAddress, uint16_t argQuantity, uint32_t argPeriodUs, uint8_t argPriority = 0){
+    station = argStation;
+    functionCode = argFunctionCode;
+    startAddress = argStartAddress;
+    quantity = argQuantity;
+    periodUs = argPeriodUs;
+    priority = argPriority;
+    enabled = true;
+    userData = 0;
+    clearStatics();
+  }
+  inline void clearStatics(){ polls = 0; failures = 0; missedDeadlines = 0; }
+};
+
+//主站到一个从站的链路状态, 由用户提供的数组保存, 下标为站号
+//回复延时按TCP的SRTT/RTTVAR平滑(RFC 6298), 单位微秒
+class ModbusStationLink{
+public:
+  uint32_t srtt;     //平滑后的回复延时: 请求发完到回复开始到达
+  uint32_t rttvar;   //延时的平均偏差
+  uint32_t timeout;  //下一次请求等待回复的时间
+  uint32_t samples;
+  //断路器: 连续失败达到阈值后断开, 退避期间不发送, 到期后放行一次探测
+  uint8_t failures;  //连续失败(重试用完)的请求数
+  uint32_t backoff;  //当前退避时间, 0表示链路正常
+  uint32_t probeAt;  //断开期间到此时刻后允许探测
+  bool probeDue;     //退避已到期, 锁存到探测有结果为止, 之后不再比较会回绕的时间
+  uint32_t trips;    //断开次数
+
+  inline void clear(uint32_t initialTimeout){
+    srtt = 0; rttvar = 0; timeout = initialTimeout; samples = 0;
+    failures = 0; backoff = 0; probeAt = 0; probeDue = false; trips = 0;
+  }
+  inline bool isOpen(uint32_t now){
+    if(backoff == 0 || probeDue) return false;
+    if(now - (probeAt - backoff) >= backoff){  //从断开时刻算经过的时间, 不受回绕影响
+      probeDue = true;
+      return false;
+    }
+    return true;
+  }
+};
+
 class ModbusRS485Master : public ModbusRS485 {
 public:
+#if MODBUS_USE_RS485
   ModbusRS485Master(HardwareSerial& serial, CRC16 *modbusCRC = 0);
   void begin(size_t baud, uint32_t config, int16_t rxPin, int16_t txPin, int16_t dePin, int16_t rePin, bool readBack, uint32_t pWaitSlaveTimedoutUs);
   void begin(size_t baud, uint32_t config = SERIAL_8N1, int16_t rxPin=-1, int16_t txPin=-1, int16_t dePin=-1, int16_t rePin = -1, bool readBack = false);
   void begin(RS485Config conf,uint32_t pWaitSlaveTimedoutUs);
   void begin(RS485Config conf);
-  void update();
+#else
+  ModbusRS485Master(ModbusTransport& argTransport, CRC16 *modbusCRC = 0);
+  void begin(size_t baud, uint32_t config = SERIAL_8N1);
+  void begin(size_t baud, uint32_t config, uint32_t pWaitSlaveTimedoutUs);
+#endif
+  uint32_t update();  //返回距下一个内部期限(帧间隔、回复延时、等待从机超时)的微秒数, 没有时返回NoDeadline
+  uint32_t getTimeToDeadline();
+  bool wait(uint32_t maxWaitUs = NoDeadline);  //休眠到数据到达或下一个期限
   bool availableToTransmit();
   void transmitOnUpdate(uint8_t targetStation);
   bool transmit(uint8_t targetStation);
   bool transmitRaw(uint8_t targetStation, uint16_t length);
   void processPack();
+  //轮询调度: 总线空闲时update()自动发出下一个到期的任务, 回复照常通过onReceived送达
+  bool setPollJobs(ModbusPollJob *jobs, uint16_t count);
+  inline void clearPollJobs(){ pollJobs = 0; pollJobCount = 0; activeJob = 0; }
+  inline ModbusPollJob *getActiveJob(){ return activeJob; }  //onReceived中表示这个回复属于哪个任务, 手动发送时为0
+  //按站号自适应等待回复超时: links[station]记录延时, 超时取SRTT+4*RTTVAR并限制在[floorUs, ceilingUs]
+  //没有设置或站号超出count时使用固定的waitSlavePackTimedout
+  bool setStationLinks(ModbusStationLink *links, uint16_t count, uint32_t floorUs, uint32_t ceilingUs);
+  inline void clearStationLinks(){ stationLinks = 0; stationLinkCount = 0; }
+  inline ModbusStationLink *getStationLink(uint8_t st){ return st < stationLinkCount ? &stationLinks[st] : 0; }
+  uint32_t getResponseTimeout(uint8_t st);
+  //超时或校验失败时用缓存的请求重发count次, 都失败才通过onReceived报告
+  inline void setRetries(uint8_t count){ maxRetries = count; }
+  //连续threshold个请求失败后断开该站, 退避从baseUs开始每次探测失败加倍到maxUs, threshold为0时关闭
+  //需要先setStationLinks; 断开期间transmit(该站)返回false, 轮询任务跳过该站
+  void setCircuitBreaker(uint8_t threshold, uint32_t baseUs, uint32_t maxUs);
+  bool isStationAvailable(uint8_t st);
+  inline uint32_t getRetryPacks(){ return retryPacks; }
+  //广播(站号0)只能是写请求, 发出后不等待回复, 间隔转换延时后才能发下一帧(规范建议100~200ms)
+  inline void setBroadcastTurnaround(uint32_t us){ broadcastTurnaround = us; }
+  inline bool isWaitingResponse(){ return waitSlaveResponse; }
 private:
+  void initMaster();
   void onGetPack();
+  void finishPollJob();
+  void dispatchPollJob();
+  uint32_t getTimeToNextPollJob(uint32_t now);
+  ModbusPollJob *pollJobs;
+  uint16_t pollJobCount;
+  ModbusPollJob *activeJob;
   bool transmitOnUpdateFlag;
   uint8_t transmitTargetStation;
   uint32_t waitSlavePackTick;
   uint32_t waitSlavePackTimedout;
   uint8_t waitSlaveResponse;
+  uint8_t waitStation;           //正在等待回复的站号
+  uint32_t waitTimeout;          //本次请求的等待超时
+  bool responseStarted;          //回复已开始到达, 之后由帧间隔结束接收
+  uint32_t responseStartTick;
+  ModbusStationLink *stationLinks;
+  uint16_t stationLinkCount;
+  uint32_t responseTimeoutFloor;
+  uint32_t responseTimeoutCeiling;
+  uint8_t maxRetries;
+  uint8_t retriesLeft;
+  bool retryPending;             //等帧间隔过后重发txFrame中缓存的请求
+  uint8_t retryFailType;         //触发重试的那次失败, 重试被放弃时按它通知
+  uint16_t txLength;             //上一个请求的帧长(含CRC)
+  uint32_t retryPacks;
+  uint8_t breakerThreshold;
+  uint32_t breakerBaseBackoff;
+  uint32_t breakerMaxBackoff;
+  uint32_t broadcastTurnaround;
+  uint32_t turnaroundTick;
+  bool turnaroundPending;        //广播之后的转换延时
+
+  bool canTransmit(uint8_t targetStation, uint8_t functionCode);
+  void beginTransaction(uint8_t targetStation);
+  void beginWaitResponse(uint8_t targetStation);
+  bool isResponseValid();
+  bool retryOnFailure();
+  void dispatchRetry();
+  void abandonRetry();
+  void updateStationLink(uint8_t st, uint32_t rtt);
+  void backoffStationLink(uint8_t st);
+  void recordStationResult(uint8_t st, bool success);
+  inline bool isInTurnaround(uint32_t now){
+    if(!turnaroundPending) return false;
+    if(now - turnaroundTick <= broadcastTurnaround) return true;
+    turnaroundPending = false;  //到期后清除, 否则micros()回绕一圈后又会判为转换中
+    return false;
+  }
+  inline bool isStationOpen(uint8_t st, uint32_t now){
+    ModbusStationLink *link = getStationLink(st);
+    return breakerThreshold && link && link->isOpen(now);
+  }
 };
 
 class ModbusRS485Slave : public ModbusRS485 {
 public:
+#if MODBUS_USE_RS485
   ModbusRS485Slave(HardwareSerial& serial, CRC16 *modbusCRC = 0);
   void begin(uint8_t station, size_t baud, uint32_t config = SERIAL_8N1, int16_t rxPin=-1, int16_t txPin=-1, int16_t dePin=-1, int16_t rePin = -1, bool readBack = false);
   void begin(uint8_t station, RS485Config conf);
-  void update();
+#else
+  ModbusRS485Slave(ModbusTransport& argTransport, CRC16 *modbusCRC = 0);
+  void begin(uint8_t station, size_t baud, uint32_t config = SERIAL_8N1);
+#endif
+  uint32_t update();  //返回距下一个内部期限(帧间隔、回复延时)的微秒数, 没有时返回NoDeadline
+  uint32_t getTimeToDeadline();
+  bool wait(uint32_t maxWaitUs = NoDeadline);
   bool availableToTransmit();
   void transmitOnUpdate();
   bool transmit();
@@ -133,9 +391,15 @@ public:
   void processPack();
   uint8_t getStation();
   bool setStation(uint8_t station);
+  inline bool isBroadcast(){ return rxFrame.getStation() == BroadcastStation; }
+  //请求是发给本站的, 或者是允许广播的写请求; 广播请求照常处理, transmit()不会回复
+  inline bool isAddressed(){
+    return rxFrame.getStation() == station || (isBroadcast() && isBroadcastFunctionCode(rxFrame.getFunctionCode()));
+  }
 private:
   void onGetPack();
   bool transmitOnUpdateFlag;
+  bool broadcastRequest;  //最近收到的请求是广播
   uint8_t station;
   uint8_t isAllowedToTransmit;
 };
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "ModbusBits.h"
+#include <string.h>
+
+//按小端读取count(1~8)个字节
+static inline uint64_t loadLE(const uint8_t *p, uint8_t count){
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    if(count == 8){
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return v;
+    }
+#endif
+    uint64_t v = 0;
+    for(uint8_t i = 0; i < count; i++) v |= (uint64_t)p[i] << (i * 8);
+    return v;
+}
+
+static inline void storeLE(uint8_t *p, uint64_t v, uint8_t count){
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    if(count == 8){
+        memcpy(p, &v, 8);
+        return;
+    }
+#endif
+    for(uint8_t i = 0; i < count; i++) p[i] = (uint8_t)(v >> (i * 8));
+}
+
+static inline uint64_t bitMask(uint8_t n){
+    return n >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1);
+}
+
+//读取从bit开始的n(1~64)位, 只访问覆盖这n位的字节
+static inline uint64_t getBits(const uint8_t *src, uint32_t bit, uint8_t n){
+    const uint8_t *p = src + (bit >> 3);
+    uint8_t shift = (uint8_t)(bit & 0x07);
+    uint8_t bytes = (uint8_t)((shift + n + 7) >> 3);   //1~9
+    uint64_t v = loadLE(p, bytes > 8 ? 8 : bytes) >> shift;
+    if(bytes > 8) v |= (uint64_t)p[8] << (64 - shift);   //漏斗移位补齐高位
+    return v & bitMask(n);
+}
+
+//写入从bit开始的n(1~64)位, 范围外的位保持不变
+static inline void putBits(uint8_t *dst, uint32_t bit, uint64_t v, uint8_t n){
+    uint8_t *p = dst + (bit >> 3);
+    uint8_t shift = (uint8_t)(bit & 0x07);
+    uint8_t bytes = (uint8_t)((shift + n + 7) >> 3);   //1~9
+    uint8_t lowBytes = bytes > 8 ? 8 : bytes;
+    uint64_t mask = bitMask(n);
+    v &= mask;
+    uint64_t old = loadLE(p, lowBytes);
+    storeLE(p, (old & ~(mask << shift)) | (v << shift), lowBytes);
+    if(bytes > 8){
+        uint8_t highMask = (uint8_t)bitMask((uint8_t)(shift + n - 64));
+        p[8] = (uint8_t)((p[8] & ~highMask) | ((uint8_t)(v >> (64 - shift)) & highMask));
+    }
+}
+
+void ModbusBits::move(uint8_t *dst, uint32_t dstBit, const uint8_t *src, uint32_t srcBit, uint32_t n){
+    if(n == 0) return;
+    if(dst == src && dstBit > srcBit){ //同一缓冲区向后搬移, 从尾部开始避免覆盖未读的源数据
+        uint32_t off = n;
+        while(off > 0){
+            uint8_t k = (uint8_t)(off >= 64 ? 64 : off);
+            off -= k;
+            putBits(dst, dstBit + off, getBits(src, srcBit + off, k), k);
+        }
+    }else{
+        for(uint32_t off = 0; off < n; off += 64){
+            uint8_t k = (uint8_t)(n - off >= 64 ? 64 : n - off);
+            putBits(dst, dstBit + off, getBits(src, srcBit + off, k), k);
+        }
+    }
+}
+
+void ModbusBits::insert(uint8_t *buf, uint32_t totalBits, uint32_t atBit, const uint8_t *data, uint32_t n){
+    if(atBit > totalBits) atBit = totalBits;
+    move(buf, atBit + n, buf, atBit, totalBits - atBit);
+    move(buf, atBit, data, 0, n);
+    clearTail(buf, totalBits + n);
+}
+
+void ModbusBits::remove(uint8_t *buf, uint32_t totalBits, uint32_t atBit, uint32_t n){
+    if(atBit >= totalBits) return;
+    if(n > totalBits - atBit) n = totalBits - atBit;
+    move(buf, atBit, buf, atBit + n, totalBits - atBit - n);
+    clearTail(buf, totalBits - n);
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+
+/*******************************************位流处理*******************************************/
+//线圈/离散输入按Modbus规定小端位序存放(第0个线圈在第0字节的最低位)
+//所有操作按64位字做漏斗移位, 2000个线圈只需要几十次字操作, 不再逐字节循环
+class ModbusBits{
+public:
+  //把src从srcBit开始的n位复制到dst从dstBit开始的位置, 不影响目标范围外的位
+  //dst与src可以是同一缓冲区且范围重叠
+  static void move(uint8_t *dst, uint32_t dstBit, const uint8_t *src, uint32_t srcBit, uint32_t n);
+  //在buf(原有totalBits位)的atBit处插入data的前n位, 原atBit之后的位后移
+  static void insert(uint8_t *buf, uint32_t totalBits, uint32_t atBit, const uint8_t *data, uint32_t n);
+  //删除buf(原有totalBits位)从atBit开始的n位, 后面的位前移
+  static void remove(uint8_t *buf, uint32_t totalBits, uint32_t atBit, uint32_t n);
+  //清除最后一个字节中第totalBits位之后的无效高位
+  static inline void clearTail(uint8_t *buf, uint32_t totalBits){
+    uint8_t remainBits = (uint8_t)(totalBits & 0x07);
+    if(remainBits != 0) buf[totalBits >> 3] &= (uint8_t)((1u << remainBits) - 1u);
+  }
+};
@@ -0,0 +1,44 @@
+#include "ModbusCRC.h"
+
+/*******************************************编译期生成查表*******************************************/
+static constexpr uint16_t crcBitStep(uint16_t crc, uint8_t bits){
+    return bits == 0 ? crc : crcBitStep((crc & 0x0001) ? (uint16_t)((crc >> 1) ^ 0xA001) : (uint16_t)(crc >> 1), bits - 1);
+}
+static constexpr uint16_t crcZeroByte(uint16_t crc){   //再追加一个0字节
+    return (uint16_t)((crc >> 8) ^ crcBitStep(crc & 0xFF, 8));
+}
+static constexpr uint16_t crcEntry(uint8_t slice, uint16_t i){
+    return slice == 0 ? crcBitStep(i, 8) : crcZeroByte(crcEntry(slice - 1, i));
+}
+static_assert(crcEntry(0, 0x01) == 0xC0C1, "CRC16/MODBUS table mismatch");
+static_assert(crcEntry(0, 0xFF) == 0x4040, "CRC16/MODBUS table mismatch");
+
+#define CRC_E4(s, i) crcEntry(s, (i)), crcEntry(s, (i) + 1), crcEntry(s, (i) + 2), crcEntry(s, (i) + 3)
+#define CRC_E16(s, i) CRC_E4(s, (i)), CRC_E4(s, (i) + 4), CRC_E4(s, (i) + 8), CRC_E4(s, (i) + 12)
+#define CRC_E64(s, i) CRC_E16(s, (i)), CRC_E16(s, (i) + 16), CRC_E16(s, (i) + 32), CRC_E16(s, (i) + 48)
+#define CRC_ROW(s) { CRC_E64(s, 0), CRC_E64(s, 64), CRC_E64(s, 128), CRC_E64(s, 192) }
+
+const uint16_t gModbusCRCTable[MODBUS_CRC_TABLE_SLICES][256] = {
+    CRC_ROW(0),
+#if MODBUS_CRC_TABLE_SLICES == 8
+    CRC_ROW(1), CRC_ROW(2), CRC_ROW(3), CRC_ROW(4), CRC_ROW(5), CRC_ROW(6), CRC_ROW(7),
+#endif
+};
+
+/*******************************************CRC计算*******************************************/
+uint16_t ModbusCRC::update(uint16_t crc, const uint8_t *data, uint16_t length){
+#if MODBUS_CRC_TABLE_SLICES == 8
+    const uint16_t (*t)[256] = gModbusCRCTable;
+    while(length >= 8){ //每次8字节, 8次查表互不依赖
+        crc ^= (uint16_t)(data[0] | (data[1] << 8));
+        crc = t[7][crc & 0xFF] ^ t[6][crc >> 8] ^ t[5][data[2]] ^ t[4][data[3]]
+            ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+        data += 8;
+        length -= 8;
+    }
+#endif
+    while(length--){
+        crc = updateByte(crc, *data++);
+    }
+    return crc;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+
+/*******************************************Modbus CRC16引擎*******************************************/
+//内置的CRC16/MODBUS (多项式0xA001反射, 初值0xFFFF), 结果与CRC16(CRC16MODBUS)完全一致
+//查表在编译期由constexpr生成, 存放在只读区
+//引擎在编译期选择, 例如 -DMODBUS_CRC_ENGINE=MODBUS_CRC_ENGINE_SLICE8
+#define MODBUS_CRC_ENGINE_EXTERNAL 0  //使用外部CRC16对象(gModbusCRC), 与旧版本行为一致
+#define MODBUS_CRC_ENGINE_TABLE 1     //单字节查表, 表大小512字节
+#define MODBUS_CRC_ENGINE_SLICE8 2    //slice-by-8, 每次处理8字节, 表大小4KB, 适合256字节的长帧
+
+#ifndef MODBUS_CRC_ENGINE
+#define MODBUS_CRC_ENGINE MODBUS_CRC_ENGINE_TABLE
+#endif
+
+#if MODBUS_CRC_ENGINE == MODBUS_CRC_ENGINE_SLICE8
+#define MODBUS_CRC_TABLE_SLICES 8
+#else
+#define MODBUS_CRC_TABLE_SLICES 1
+#endif
+
+//gModbusCRCTable[k][i]: 字节i后面再跟k个0字节的CRC余数
+extern const uint16_t gModbusCRCTable[MODBUS_CRC_TABLE_SLICES][256];
+
+class ModbusCRC{
+public:
+  static const uint16_t Init = 0xFFFF;
+  //逐字节累加, 用于边接收边计算
+  static inline uint16_t updateByte(uint16_t crc, uint8_t d){
+    return (uint16_t)((crc >> 8) ^ gModbusCRCTable[0][(crc ^ d) & 0xFF]);
+  }
+  //按编译期选择的引擎累加一段数据
+  static uint16_t update(uint16_t crc, const uint8_t *data, uint16_t length);
+  static inline uint16_t compute(const uint8_t *data, uint16_t length){
+    return update(Init, data, length);
+  }
+};
@@ -0,0 +1,214 @@
+#include "ModbusGateway.h"
+/* Modbus TCP->RTU 网关 */
+#if defined(__linux__)
+
+ModbusGateway::ModbusGateway(){
+  maxQueuePerBus = NoIndex;
+  rejectedRequests = 0;
+  busCount = 0;
+  requests = 0;
+  requestCount = 0;
+  freeRequest = NoIndex;
+  memset(routes, NoRoute, sizeof(routes));
+}
+
+bool ModbusGateway::begin(ModbusTCPConnection *connectionPool, uint16_t poolSize, ModbusGatewayRequest *requestPool, uint16_t argRequestCount, uint16_t port, const char *bindAddress){
+  if(requestPool == 0 || argRequestCount == 0 || argRequestCount == NoIndex) return false;
+  requests = requestPool;
+  requestCount = argRequestCount;
+  for(uint16_t i=0; i<requestCount; i++){ //建立空闲链表
+    requests[i].next = (i+1 < requestCount) ? (uint16_t)(i+1) : NoIndex;
+  }
+  freeRequest = 0;
+  for(uint8_t b=0; b<busCount; b++){
+    buses[b].head = buses[b].tail = buses[b].active = NoIndex;
+    buses[b].queued = 0;
+  }
+  server.onReceived = onServerReceived;
+  server.userData = this;
+  return server.begin(connectionPool, poolSize, port, bindAddress);
+}
+
+void ModbusGateway::end(){
+  server.end();
+  for(uint8_t b=0; b<busCount; b++){
+    buses[b].head = buses[b].tail = buses[b].active = NoIndex;
+    buses[b].queued = 0;
+  }
+  requests = 0;
+  requestCount = 0;
+  freeRequest = NoIndex;
+}
+
+int8_t ModbusGateway::addBus(ModbusRS485Master &master){
+  if(busCount >= MaxBuses) return -1;
+  ModbusGatewayBus &b = buses[busCount];
+  b.master = &master;
+  b.head = b.tail = b.active = NoIndex;
+  b.queued = 0;
+  b.lastConnection = 0;
+  b.forwarded = 0;
+  b.failed = 0;
+  master.onReceived = onBusReceived;
+  master.userData = this;
+  return (int8_t)(busCount++);
+}
+
+bool ModbusGateway::setRoute(uint8_t firstUnit, uint8_t lastUnit, uint8_t bus){
+  if(bus >= busCount || firstUnit > lastUnit) return false;
+  for(uint16_t unit=firstUnit; unit<=lastUnit; unit++) routes[unit] = bus;
+  return true;
+}
+
+void ModbusGateway::update(int timeoutMs){
+  server.update(timeoutMs);
+  for(uint8_t b=0; b<busCount; b++){
+    buses[b].master->update();
+    dispatch(b);  //回复或超时处理完后立即发下一帧, 总线不空闲
+  }
+}
+
+void ModbusGateway::onServerReceived(ModbusTCPServer *tcpServer){
+  ((ModbusGateway*)tcpServer->userData)->enqueue();
+}
+
+void ModbusGateway::onBusReceived(ModbusRS485 *modbusController){
+  ModbusGateway *gateway = (ModbusGateway*)modbusController->userData;
+  for(uint8_t b=0; b<gateway->busCount; b++){
+    if(gateway->buses[b].master == modbusController){
+      gateway->complete(b, (ModbusRS485Master*)modbusController);
+      return;
+    }
+  }
+}
+
+//TCP请求进入对应总线的队列, 回复在总线完成后再发出
+void ModbusGateway::enqueue(){
+  ModbusTCPConnection *connection = server.currentConnection;
+  ModbusFrame &rx = server.rxFrame;
+  uint8_t unit = rx.getStation();
+  uint8_t bus = routes[unit];
+  if(bus == NoRoute || freeRequest == NoIndex || buses[bus].queued >= maxQueuePerBus){
+    rejectedRequests ++;  //没有路由或网关过载
+    replyDiagnose(connection, connection->transactionID, unit, rx.getFunctionCode(), MBPDiagnose::DiagnoseCode_BadGateway);
+    return;
+  }
+  uint16_t index = freeRequest;
+  ModbusGatewayRequest &r = requests[index];
+  freeRequest = r.next;
+  r.next = NoIndex;
+  r.connection = server.getConnectionIndex(connection);
+  r.generation = connection->generation;
+  r.transactionID = connection->transactionID;
+  r.length = rx.validDataLength;
+  memcpy(r.frame, rx.buffer, r.length);
+  ModbusGatewayBus &b = buses[bus];
+  if(b.tail == NoIndex) b.head = index;
+  else requests[b.tail].next = index;
+  b.tail = index;
+  b.queued ++;
+}
+
+bool ModbusGateway::isClientAlive(ModbusGatewayRequest &r){
+  ModbusTCPConnection *connection = server.getConnection(r.connection);
+  return connection->isOpen() && connection->generation == r.generation;
+}
+
+//按连接轮询: 选上次服务的连接之后最近的那个连接的最早请求, 一个客户端发得再多也只能轮到一次
+uint16_t ModbusGateway::pickFair(ModbusGatewayBus &b){
+  uint16_t poolSize = server.getConnectionPoolSize();
+  uint16_t best = NoIndex;
+  uint16_t bestPrev = NoIndex;
+  uint16_t bestDistance = NoIndex;
+  uint16_t prev = NoIndex;
+  uint16_t index = b.head;
+  while(index != NoIndex){
+    uint16_t next = requests[index].next;
+    if(!isClientAlive(requests[index])){  //客户端已断开, 不再占用总线
+      if(prev == NoIndex) b.head = next;
+      else requests[prev].next = next;
+      if(b.tail == index) b.tail = prev;
+      b.queued --;
+      releaseRequest(index);
+      index = next;
+      continue;
+    }
+    uint16_t distance = (uint16_t)((requests[index].connection + poolSize - b.lastConnection - 1) % poolSize);
+    if(distance < bestDistance){
+      best = index;
+      bestPrev = prev;
+      bestDistance = distance;
+    }
+    prev = index;
+    index = next;
+  }
+  if(best == NoIndex) return NoIndex;
+  if(bestPrev == NoIndex) b.head = requests[best].next;
+  else requests[bestPrev].next = requests[best].next;
+  if(b.tail == best) b.tail = bestPrev;
+  b.queued --;
+  b.lastConnection = requests[best].connection;
+  return best;
+}
+
+void ModbusGateway::dispatch(uint8_t bus){
+  ModbusGatewayBus &b = buses[bus];
+  if(b.isBusy() || b.head == NoIndex || !b.master->availableToTransmit()) return;
+  uint16_t index = pickFair(b);
+  if(index == NoIndex) return;
+  ModbusGatewayRequest &r = requests[index];
+  ModbusFrame &tx = b.master->txFrame;
+  memcpy(tx.buffer, r.frame, r.length);
+  uint16_t crc = tx.calcCRC(r.length);
+  tx.buffer[r.length] = (uint8_t)(crc & 0xFF);
+  tx.buffer[r.length+1] = (uint8_t)(crc >> 8);
+  b.active = index;
+  if(!b.master->transmitRaw(r.frame[0], (uint16_t)(r.length + 2))){  //从站已断开或广播了读请求
+    b.active = NoIndex;
+    if(isClientAlive(r)) replyDiagnose(server.getConnection(r.connection), r.transactionID, r.frame[0], r.frame[1], MBPDiagnose::DiagnoseCode_SlaveNoResponse);
+    b.failed ++;
+    releaseRequest(index);
+  }else if(!b.master->isWaitingResponse()){  //广播没有回复, 也不回复TCP客户端
+    b.active = NoIndex;
+    b.forwarded ++;
+    releaseRequest(index);
+  }
+}
+
+//总线回复(或超时)后把RTU帧去掉CRC原样转回TCP
+void ModbusGateway::complete(uint8_t bus, ModbusRS485Master *master){
+  ModbusGatewayBus &b = buses[bus];
+  if(!b.isBusy()) return;  //不是网关发出的请求(例如超时后迟到的回复)
+  uint16_t index = b.active;
+  b.active = NoIndex;
+  ModbusGatewayRequest &r = requests[index];
+  if(isClientAlive(r)){
+    ModbusTCPConnection *connection = server.getConnection(r.connection);
+    ModbusFrame &rx = master->rxFrame;
+    uint16_t length = rx.validDataLength;
+    bool valid = master->failType == ModbusRS485::RcvNoFail && length >= 4 && length <= ModbusTCP::MaxPDUSize+3
+      && rx.buffer[0] == r.frame[0] && (rx.buffer[1] & 0x7F) == r.frame[1] && rx.calcCRC(length) == 0;
+    if(valid){
+      memcpy(server.txFrame.buffer, rx.buffer, length-2);
+      server.transmitRaw(connection, r.transactionID, (uint16_t)(length-2));
+      b.forwarded ++;
+    }else{
+      replyDiagnose(connection, r.transactionID, r.frame[0], r.frame[1], MBPDiagnose::DiagnoseCode_SlaveNoResponse);
+      b.failed ++;
+    }
+  }
+  releaseRequest(index);
+}
+
+void ModbusGateway::replyDiagnose(ModbusTCPConnection *connection, uint16_t transactionID, uint8_t unitID, uint8_t functionCode, uint8_t diagnoseCode){
+  server.txFrame.createDiagnose(functionCode);
+  server.txFrame.view<MBVDiagnose>().setDiagnoseCode(diagnoseCode);  //异常码原样写入
+  server.transmit(connection, transactionID, unitID);
+}
+
+void ModbusGateway::releaseRequest(uint16_t index){
+  requests[index].next = freeRequest;
+  freeRequest = index;
+}
+
+#endif
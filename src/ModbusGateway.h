@@ -0,0 +1,72 @@
+#pragma once
+#include "Modbus.h"
+#include "ModbusTCP.h"
+
+//Modbus TCP转RTU网关, 依赖ModbusTCPServer, 仅在Linux上可用
+#if defined(__linux__)
+
+/*******************************************Modbus TCP->RTU 网关*******************************************/
+//排队中的一个TCP请求, 由用户提供的数组分配
+class ModbusGatewayRequest{
+public:
+  uint16_t next;            //所在总线队列或空闲链表
+  uint16_t connection;      //TCP连接序号
+  uint16_t generation;      //连接的代数, 客户端断开后不再回复
+  uint16_t transactionID;
+  uint16_t length;          //单元号+PDU
+  uint8_t frame[ModbusTCP::MaxPDUSize+1+2];  //末尾留出CRC的位置, 直接作为RTU帧发出
+};
+
+//一条下游RS485总线
+class ModbusGatewayBus{
+public:
+  ModbusRS485Master *master;
+  uint16_t head;            //队列(单向链表)
+  uint16_t tail;
+  uint16_t queued;
+  uint16_t active;          //正在总线上等待回复的请求
+  uint16_t lastConnection;  //上次服务的连接, 轮询从它的下一个开始
+  uint32_t forwarded;
+  uint32_t failed;
+  inline bool isBusy(){ return active != 0xFFFF; }
+};
+
+class ModbusGateway{
+public:
+  static const uint16_t NoIndex = 0xFFFF;
+  static const uint8_t MaxBuses = 8;
+  static const uint8_t NoRoute = 0xFF;
+
+  ModbusTCPServer server;
+  uint16_t maxQueuePerBus;  //单条总线最多排队的请求, 超过时回复0x0A
+  uint32_t rejectedRequests;
+
+  ModbusGateway();
+  bool begin(ModbusTCPConnection *connectionPool, uint16_t poolSize, ModbusGatewayRequest *requestPool, uint16_t requestCount, uint16_t port = ModbusTCP::DefaultPort, const char *bindAddress = 0);
+  void end();
+  int8_t addBus(ModbusRS485Master &master);  //返回总线序号, 失败返回-1; master需已begin
+  bool setRoute(uint8_t firstUnit, uint8_t lastUnit, uint8_t bus);  //单元号范围转发到指定总线
+  void update(int timeoutMs = 0);
+
+  inline uint8_t getBusCount(){ return busCount; }
+  inline ModbusGatewayBus *getBus(uint8_t bus){ return &buses[bus]; }
+private:
+  ModbusGatewayBus buses[MaxBuses];
+  uint8_t busCount;
+  uint8_t routes[256];
+  ModbusGatewayRequest *requests;
+  uint16_t requestCount;
+  uint16_t freeRequest;
+
+  static void onServerReceived(ModbusTCPServer *tcpServer);
+  static void onBusReceived(ModbusRS485 *modbusController);
+  void enqueue();
+  void dispatch(uint8_t bus);
+  void complete(uint8_t bus, ModbusRS485Master *master);
+  uint16_t pickFair(ModbusGatewayBus &b);
+  bool isClientAlive(ModbusGatewayRequest &r);
+  void replyDiagnose(ModbusTCPConnection *connection, uint16_t transactionID, uint8_t unitID, uint8_t functionCode, uint8_t diagnoseCode);
+  void releaseRequest(uint16_t index);
+};
+
+#endif
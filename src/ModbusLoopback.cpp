@@ -0,0 +1,182 @@
+#include "ModbusLoopback.h"
+/* 内存中的模拟总线 */
+
+static const uint64_t ModbusLoopbackNever = 0xFFFFFFFFFFFFFFFFULL;
+
+ModbusLoopbackBus::ModbusLoopbackBus(){
+  propagationDelayNs = 0;
+  ports = 0;
+  nowNs = 0;
+  clearStatics();
+}
+
+void ModbusLoopbackBus::attach(ModbusLoopbackPort *port){
+  port->next = ports;
+  ports = port;
+}
+
+void ModbusLoopbackBus::detach(ModbusLoopbackPort *port){
+  ModbusLoopbackPort **link = &ports;
+  while(*link){
+    if(*link == port){
+      *link = port->next;
+      return;
+    }
+    link = &(*link)->next;
+  }
+}
+
+void ModbusLoopbackBus::advance(uint32_t us){
+  advanceTo(nowNs + (uint64_t)us*1000);
+}
+
+void ModbusLoopbackBus::advanceTo(uint64_t ns){
+  if(ns < nowNs) return;
+  deliver(ns);
+  nowNs = ns;
+}
+
+uint64_t ModbusLoopbackBus::getNextEventNanos(){
+  uint64_t next = ModbusLoopbackNever;
+  for(ModbusLoopbackPort *p = ports; p; p = p->next){
+    if(p->txCount == 0) continue;
+    uint64_t arrival = p->txStart[p->txHead] + p->characterNs + propagationDelayNs;
+    if(arrival < next) next = arrival;
+  }
+  return next;
+}
+
+bool ModbusLoopbackBus::isIdle(){
+  return getNextEventNanos() == ModbusLoopbackNever;
+}
+
+//按到达时间顺序投递, 多个节点的字符交错时各接收方看到的顺序一致
+void ModbusLoopbackBus::deliver(uint64_t untilNs){
+  while(true){
+    ModbusLoopbackPort *sender = 0;
+    uint64_t first = ModbusLoopbackNever;
+    for(ModbusLoopbackPort *p = ports; p; p = p->next){
+      if(p->txCount == 0) continue;
+      uint64_t arrival = p->txStart[p->txHead] + p->characterNs + propagationDelayNs;
+      if(arrival < first){
+        first = arrival;
+        sender = p;
+      }
+    }
+    if(sender == 0 || first > untilNs) return;
+    uint8_t d = sender->txData[sender->txHead];
+    sender->txHead = (sender->txHead + 1) % ModbusLoopbackPort::BufferSize;
+    sender->txCount --;
+    for(ModbusLoopbackPort *p = ports; p; p = p->next){
+      if(p == sender) continue;  //半双工, 不回读自己发出的数据
+      if(p->baudrate != sender->baudrate || p->serialConfig != sender->serialConfig){
+        p->framingErrors ++;
+        continue;
+      }
+      p->receive(d);
+    }
+    deliveredBytes ++;
+  }
+}
+
+ModbusLoopbackPort::ModbusLoopbackPort(ModbusLoopbackBus &argBus, uint32_t baud, uint32_t config) : bus(argBus){
+  next = 0;
+  overruns = 0;
+  framingErrors = 0;
+  txBusyUntil = 0;
+  rxHead = rxCount = 0;
+  txHead = txCount = 0;
+  begin(baud, config);
+  bus.attach(this);
+}
+
+ModbusLoopbackPort::~ModbusLoopbackPort(){
+  bus.detach(this);
+}
+
+bool ModbusLoopbackPort::begin(uint32_t baud, uint32_t config){
+  if(baud == 0) return false;
+  baudrate = baud;
+  serialConfig = config;
+  characterNs = (uint32_t)((uint64_t)getCharacterBits(config)*1000000000ULL/baud);
+  return true;
+}
+
+int ModbusLoopbackPort::available(){
+  return rxCount;
+}
+
+size_t ModbusLoopbackPort::readBytes(uint8_t *data, size_t length){
+  size_t n = 0;
+  while(n < length && rxCount > 0){
+    data[n++] = rxBuffer[rxHead];
+    rxHead = (rxHead + 1) % BufferSize;
+    rxCount --;
+  }
+  return n;
+}
+
+//每个字符紧接着上一个字符发出, 与其他节点还在线上的字符时间重叠时两边都被破坏
+size_t ModbusLoopbackPort::writeBytes(const uint8_t *data, size_t length){
+  size_t n = 0;
+  while(n < length && txCount < BufferSize){
+    uint64_t start = txBusyUntil > bus.nowNs ? txBusyUntil : bus.nowNs;
+    uint64_t end = start + characterNs;
+    uint8_t d = data[n];
+    bool collided = false;
+    for(ModbusLoopbackPort *p = bus.ports; p; p = p->next){
+      if(p != this && p->collide(start, end, d)) collided = true;
+    }
+    if(collided) bus.collisions ++;
+    uint16_t tail = (txHead + txCount) % BufferSize;
+    txData[tail] = d;
+    txStart[tail] = start;
+    txCount ++;
+    txBusyUntil = end;
+    n ++;
+  }
+  return n;
+}
+
+//总线空闲为高电平, 冲突的位按线与处理
+bool ModbusLoopbackPort::collide(uint64_t start, uint64_t end, uint8_t &d){
+  bool collided = false;
+  for(uint16_t i=0; i<txCount; i++){
+    uint16_t index = (txHead + i) % BufferSize;
+    uint64_t otherStart = txStart[index];
+    if(otherStart >= end) break;
+    if(otherStart + characterNs <= start) continue;
+    d &= txData[index];
+    txData[index] = d;
+    collided = true;
+  }
+  return collided;
+}
+
+void ModbusLoopbackPort::receive(uint8_t d){
+  if(rxCount >= BufferSize){
+    overruns ++;
+    return;
+  }
+  rxBuffer[(rxHead + rxCount) % BufferSize] = d;
+  rxCount ++;
+}
+
+void ModbusLoopbackPort::beginTransmission(){}
+
+void ModbusLoopbackPort::endTransmission(){
+  bus.advanceTo(txBusyUntil);
+}
+
+uint32_t ModbusLoopbackPort::micros(){
+  return bus.micros();
+}
+
+bool ModbusLoopbackPort::wait(uint32_t timeoutUs){
+  if(rxCount > 0) return true;
+  uint64_t target = bus.getNextEventNanos();
+  if(timeoutUs != WaitForever && bus.nowNs + (uint64_t)timeoutUs*1000 < target) target = bus.nowNs + (uint64_t)timeoutUs*1000;
+  if(target == ModbusLoopbackNever) return false;  //没有任何事件, 不能无限等待
+  bus.advanceTo(target);
+  return rxCount > 0;
+}
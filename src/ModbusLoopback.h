@@ -0,0 +1,73 @@
+#pragma once
+#include "ModbusTransport.h"
+
+/*******************************************内存中的模拟总线*******************************************/
+//在一个进程内把任意数量的主站/从站连到一条模拟的半双工总线上, 用虚拟时钟按波特率逐字符投递
+//时间只在advance()/endTransmission()中前进, 结果与运行速度无关, 可以在CI上确定性地测吞吐和延迟
+class ModbusLoopbackPort;
+
+class ModbusLoopbackBus{
+public:
+  uint32_t propagationDelayNs;  //线缆传播延迟, 字符发完到对端收到的时间
+  uint32_t collisions;          //两个节点同时发送而损坏的字符数
+  uint32_t deliveredBytes;
+
+  ModbusLoopbackBus();
+  void advance(uint32_t us);      //虚拟时钟前进, 到期的字符投递到各节点的接收缓冲区
+  void advanceTo(uint64_t ns);
+  uint64_t getNextEventNanos();   //下一个字符到达的时间, 总线空闲时返回0xFFFFFFFFFFFFFFFF
+  bool isIdle();
+  inline uint64_t getNanos(){ return nowNs; }
+  inline uint32_t micros(){ return (uint32_t)(nowNs/1000); }
+  inline void clearStatics(){ collisions = 0; deliveredBytes = 0; }
+private:
+  friend class ModbusLoopbackPort;
+  ModbusLoopbackPort *ports;  //挂在总线上的节点(单向链表)
+  uint64_t nowNs;
+
+  void attach(ModbusLoopbackPort *port);
+  void detach(ModbusLoopbackPort *port);
+  void deliver(uint64_t untilNs);
+};
+
+//总线上的一个节点, 作为ModbusRS485的传输层
+class ModbusLoopbackPort : public ModbusTransport{
+public:
+  static const uint16_t BufferSize = 512;
+  uint32_t overruns;       //接收缓冲区满丢弃的字节
+  uint32_t framingErrors;  //和发送方波特率或帧格式不一致而丢弃的字节
+
+  ModbusLoopbackPort(ModbusLoopbackBus &argBus, uint32_t baud = 9600, uint32_t config = SERIAL_8N1);
+  ~ModbusLoopbackPort();
+  bool begin(uint32_t baud, uint32_t config);
+  inline uint32_t getCharacterNanos(){ return characterNs; }
+  inline ModbusLoopbackBus &getBus(){ return bus; }
+
+  int available();
+  size_t readBytes(uint8_t *data, size_t length);
+  size_t writeBytes(const uint8_t *data, size_t length);
+  void beginTransmission();
+  void endTransmission();  //和真实串口的flush一样等到最后一个字符发完, 虚拟时钟随之前进
+  uint32_t micros();
+  bool wait(uint32_t timeoutUs);  //虚拟时钟直接前进到下一个字符到达或超时, 适合只有一个节点在等待的场景
+private:
+  friend class ModbusLoopbackBus;
+  ModbusLoopbackBus &bus;
+  ModbusLoopbackPort *next;
+  uint32_t baudrate;
+  uint32_t serialConfig;
+  uint32_t characterNs;
+  uint64_t txBusyUntil;  //本节点最后一个字符发完的时间
+  //接收缓冲区(环形)
+  uint8_t rxBuffer[BufferSize];
+  uint16_t rxHead;
+  uint16_t rxCount;
+  //已写入但还在线上的字符(环形), 按开始时间排列
+  uint8_t txData[BufferSize];
+  uint64_t txStart[BufferSize];
+  uint16_t txHead;
+  uint16_t txCount;
+
+  void receive(uint8_t d);
+  bool collide(uint64_t start, uint64_t end, uint8_t &d);
+};
@@ -1,4 +1,5 @@
 #include "ModbusPack.h"
+#include "ModbusBits.h"
 #include <string.h>
 
 CRC16 gModbusCRC(CRC16MODBUS);
@@ -17,34 +18,78 @@ ModbusFrame::ModbusFrame(CRC16 *crcmgr) {
 }
 
 ModbusFrame::~ModbusFrame() {
-    if (pack) delete pack;
+    releasePack();
+}
+
+void ModbusFrame::releasePack() {
+    if (pack) {
+        pack->~ModbusBasePack();   //原地存储, 只析构不释放
+        pack = 0;
+    }
 }
 
 void ModbusFrame::copy(ModbusFrame &frame, uint16_t length){
     memcpy(buffer,frame.buffer,length);
 }
 
-uint8_t* ModbusFrame::castRequest(bool isNew) {
-    if (pack) {
-        delete pack;
-        pack = 0;
+//根据已接收的字节预测整帧长度(站号+PDU+CRC), 长度还不能确定或功能码未知时返回0
+uint16_t ModbusFrame::expectedRequestLength(uint16_t received) {
+    if (received < 2) return 0;
+    switch (buffer[1]) {
+    case MBPReadCoilRegisterRequest::FunctionCode:
+    case MBPReadDiscreteInputRegisterRequest::FunctionCode:
+    case MBPReadHoldingRegisterRequest::FunctionCode:
+    case MBPReadInputRegisterRequest::FunctionCode:
+    case MBPWriteCoilRegisterRequest::FunctionCode:
+    case MBPWriteHoldingRegisterRequest::FunctionCode:
+        return 8;
+    case MBPWriteMultipleCoilRegistersRequest::FunctionCode:
+    case MBPWriteMultipleHoldingRegistersRequest::FunctionCode:
+        return received < 7 ? 0 : (uint16_t)(9 + buffer[6]);   //字节数在第7字节
+    case MBPMaskWriteRegisterRequest::FunctionCode:
+        return 10;
+    case MBPReadWriteMultipleRegistersRequest::FunctionCode:
+        return received < 11 ? 0 : (uint16_t)(13 + buffer[10]);   //字节数在第11字节
     }
+    return 0;
+}
+
+uint16_t ModbusFrame::expectedResponseLength(uint16_t received) {
+    if (received < 2) return 0;
+    if (buffer[1] & MBPDiagnose::FunctionCode) return 5;  //异常回复: 站号+功能码+异常码+CRC
+    switch (buffer[1]) {
+    case MBPReadCoilRegisterResponse::FunctionCode:
+    case MBPReadDiscreteInputRegisterResponse::FunctionCode:
+    case MBPReadHoldingRegisterResponse::FunctionCode:
+    case MBPReadInputRegisterResponse::FunctionCode:
+    case MBPReadWriteMultipleRegistersResponse::FunctionCode:
+        return received < 3 ? 0 : (uint16_t)(5 + buffer[2]);   //字节数在第3字节
+    case MBPWriteCoilRegisterResponse::FunctionCode:
+    case MBPWriteHoldingRegisterResponse::FunctionCode:
+    case MBPWriteMultipleCoilRegistersResponse::FunctionCode:
+    case MBPWriteMultipleHoldingRegistersResponse::FunctionCode:
+        return 8;
+    case MBPMaskWriteRegisterResponse::FunctionCode:
+        return 10;
+    }
+    return 0;
+}
+
+uint8_t* ModbusFrame::castRequest(bool isNew) {
+    releasePack();
     uint8_t *pBuffer = buffer;
     pBuffer += sizeof(uint8_t);
-    pack = ModbusBasePack::CreateModbusRequestPack(pBuffer[0]);
+    pack = ModbusBasePack::CreateModbusRequestPack(pBuffer[0], packStorage);
     if(pack == 0) return 0;
     pBuffer = pack->cast(pBuffer,isNew);
     return pBuffer;
 }
 
 uint8_t* ModbusFrame::castResponse(bool isNew) {
-    if (pack) {
-        delete pack;
-        pack = 0;
-    }
+    releasePack();
     uint8_t *pBuffer = buffer;
     pBuffer += sizeof(uint8_t);
-    pack = ModbusBasePack::CreateModbusResponsePack(pBuffer[0]);
+    pack = ModbusBasePack::CreateModbusResponsePack(pBuffer[0], packStorage);
     if(pack == 0) return 0;
     pBuffer = pack->cast(pBuffer,isNew);
     if(pack->isDiagnosePack()) ((MBPDiagnose*)pack)->setDiagnoseCode(pBuffer[0]);
@@ -52,13 +97,10 @@ uint8_t* ModbusFrame::castResponse(bool isNew) {
 }
 
 uint8_t* ModbusFrame::castDiagnose(bool isNew) {
-    if (pack) {
-        delete pack;
-        pack = 0;
-    }
+    releasePack();
     uint8_t *pBuffer = buffer;
     pBuffer += sizeof(uint8_t);
-    pack = ModbusBasePack::CreateModbusDiagnosePack();
+    pack = ModbusBasePack::CreateModbusDiagnosePack(packStorage);
     if(pack == 0) return 0;
     pBuffer = pack->cast(pBuffer,isNew);
     return pBuffer;
@@ -79,38 +121,61 @@ uint8_t* ModbusFrame::createDiagnose(uint8_t functionCode) {
     return castDiagnose(true);
 }
 
-bool ModbusFrame::verifyCRC(){
+uint16_t ModbusFrame::calcCRC(uint16_t length){
+#if MODBUS_CRC_ENGINE != MODBUS_CRC_ENGINE_EXTERNAL
+    if(crcMgr == &gModbusCRC) return ModbusCRC::compute(station, length);   //默认的CRC16MODBUS由内置引擎计算
+#endif
     crcMgr->clear();
+    crcMgr->update(station, length);
+    return crcMgr->get();
+}
+
+bool ModbusFrame::verifyCRC(){
     crc = (uint16_t*)(pack->endOfPack);
     uint8_t *pCRC = (uint8_t*)crc;
-    crcMgr->update(station, (uint16_t)(pCRC - station));
     uint16_t frameCRC = (uint16_t)pCRC[0] | ((uint16_t)pCRC[1] << 8);
-    return crcMgr->get() == frameCRC;
+    return calcCRC((uint16_t)(pCRC - station)) == frameCRC;
+}
+
+//rxResidue: 接收时对整帧(含CRC字节)逐字节累加的CRC, 帧正确时为0
+//只有包尾+CRC正好是接收长度时才能直接使用, 否则回退到完整计算
+bool ModbusFrame::verifyCRC(uint16_t rxResidue){
+    crc = (uint16_t*)(pack->endOfPack);
+    if((uint8_t*)crc + sizeof(uint16_t) != buffer + validDataLength) return verifyCRC();
+    return rxResidue == 0;
 }
 
 void ModbusFrame::applyCRC(){
-    crcMgr->clear();
     crc = (uint16_t*)(pack->endOfPack);
     uint8_t *pCRC = (uint8_t*)crc;
-    crcMgr->update(station, (uint16_t)(pCRC - station));
-    setCRC(crcMgr->get());
+    setCRC(calcCRC((uint16_t)(pCRC - station)));
 }
 
 void ModbusFrame::write(Stream &s){
     crc = (uint16_t*)(pack->endOfPack);
-    uint16_t frameLength = (uint16_t)(pack->getSize() + sizeof(uint8_t) + sizeof(uint8_t));
-    s.write((uint8_t*)station, frameLength);
+    s.write((uint8_t*)station, getFrameLength());   //站号+PDU+CRC连续存放, 一次写出
+}
+
+void ModbusFrame::write(ModbusWriteHook hook, void *context){
+    crc = (uint16_t*)(pack->endOfPack);
+    ModbusIOVec iov = { station, getFrameLength() };
+    hook(context, &iov, 1);
 }
 
 void ModbusFrame::writeRaw(Stream &s, uint16_t length){
     s.write(buffer, length);
 }
 
+void ModbusFrame::writeRaw(ModbusWriteHook hook, void *context, uint16_t length){
+    ModbusIOVec iov = { buffer, length };
+    hook(context, &iov, 1);
+}
+
 
 /***************************数据包*****************************/
 //基础包
-void ModbusBasePack::write(Stream& s) {
-    s.write(functionCode, 1);
+void ModbusBasePack::write(Stream& s) {   //PDU在缓冲区中是连续的, 一次写出
+    s.write(functionCode, (size_t)(endOfPack - functionCode));
 }
 
 uint8_t* ModbusBasePack::cast(uint8_t *pBuffer, bool isNew) {
@@ -128,10 +193,6 @@ uint8_t* MBPDiagnose::cast(uint8_t *pBuffer, bool isNew) {
     setEOP(pBuffer);
     return pBuffer;
 }
-void MBPDiagnose::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)diagnoseCode, 1);
-}
 
 //读线圈寄存器0x01
 //请求
@@ -148,11 +209,6 @@ uint8_t* MBPReadCoilRegisterRequest::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPReadCoilRegisterRequest::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-}
 void MBPReadCoilRegisterRequest::popRegisters(bool fromHead, uint16_t quant){
 	UNUSED(fromHead);
     setQuantity(getQuantity()-quant);  //减去删除的寄存器数量
@@ -172,25 +228,11 @@ uint8_t* MBPReadCoilRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPReadCoilRegisterResponse::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)bytes, 1);
-    s.write((uint8_t*)values, *bytes);
-}
 void MBPReadCoilRegisterResponse::pushRegisters(bool fromHead, uint16_t quant, uint8_t *data){
-    // 计算需要的字节数
-    uint8_t newBytes = (uint8_t)((_quantity + quant + 7) >> 3);
-    uint8_t origBytes = getBytes();
-    uint8_t deltaBytes = newBytes - origBytes;
-    uint8_t *bValues = (uint8_t*)values;
-    if(fromHead){  //从头部添加
-        memmove(bValues + deltaBytes, bValues, origBytes);
-        memcpy(bValues, data, deltaBytes);
-    }else{  //从末尾添加
-        memcpy(bValues + origBytes, data, deltaBytes);
-    }
-    *bytes = newBytes;
+    //按位插入, 起始位不必是8的倍数
+    ModbusBits::insert(values, _quantity, fromHead ? 0 : _quantity, data, quant);
     _quantity += quant;
+    *bytes = (uint8_t)((_quantity + 7) >> 3);
     setEOP(((uint8_t*)values)+getBytes());
 }
 
@@ -209,11 +251,6 @@ uint8_t* MBPReadDiscreteInputRegisterRequest::cast(uint8_t *pBuffer, bool isNew)
     }
     return pBuffer;
 }
-void MBPReadDiscreteInputRegisterRequest::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-}
 void MBPReadDiscreteInputRegisterRequest::popRegisters(bool fromHead, uint16_t quant){
 	UNUSED(fromHead);
     setQuantity(getQuantity()-quant);  //减去删除的寄存器数量
@@ -233,25 +270,11 @@ uint8_t* MBPReadDiscreteInputRegisterResponse::cast(uint8_t *pBuffer, bool isNew
     }
     return pBuffer;
 }
-void MBPReadDiscreteInputRegisterResponse::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)bytes, 1);
-    s.write((uint8_t*)values, *bytes);
-}
 void MBPReadDiscreteInputRegisterResponse::pushRegisters(bool fromHead, uint16_t quant, uint8_t *data){
-    // 计算需要的字节数
-    uint8_t newBytes = (uint8_t)((_quantity + quant + 7) >> 3);
-    uint8_t origBytes = getBytes();
-    uint8_t deltaBytes = newBytes - origBytes;
-    uint8_t *bValues = (uint8_t*)values;
-    if(fromHead){  //从头部添加
-        memmove(bValues + deltaBytes, bValues, origBytes);
-        memcpy(bValues, data, deltaBytes);
-    }else{  //从末尾添加
-        memcpy(bValues + origBytes, data, deltaBytes);
-    }
-    *bytes = newBytes;
+    //按位插入, 起始位不必是8的倍数
+    ModbusBits::insert(values, _quantity, fromHead ? 0 : _quantity, data, quant);
     _quantity += quant;
+    *bytes = (uint8_t)((_quantity + 7) >> 3);
     setEOP(((uint8_t*)values)+getBytes());
 }
 
@@ -270,11 +293,6 @@ uint8_t* MBPReadHoldingRegisterRequest::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPReadHoldingRegisterRequest::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-}
 void MBPReadHoldingRegisterRequest::popRegisters(bool fromHead, uint16_t quant){
 	UNUSED(fromHead);
 	setQuantity(getQuantity()-quant);  //减去删除的寄存器数量
@@ -293,11 +311,6 @@ uint8_t* MBPReadHoldingRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPReadHoldingRegisterResponse::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)bytes, 1);
-    s.write((uint8_t*)values, *bytes);
-}
 void MBPReadHoldingRegisterResponse::pushRegisters(bool fromHead, uint16_t quant, uint8_t *data){
     _quantity = *bytes/2; //2字节
     uint8_t deltaBytes = (uint8_t)(quant*2);
@@ -328,11 +341,6 @@ uint8_t* MBPReadInputRegisterRequest::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPReadInputRegisterRequest::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-}
 void MBPReadInputRegisterRequest::popRegisters(bool fromHead, uint16_t quant){
 	UNUSED(fromHead);
 	setQuantity(getQuantity()-quant);  //减去删除的寄存器数量
@@ -356,11 +364,6 @@ uint8_t* MBPReadInputRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPReadInputRegisterResponse::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)bytes, 1);
-    s.write((uint8_t*)values, *bytes);
-}
 void MBPReadInputRegisterResponse::pushRegisters(bool fromHead, uint16_t quant, uint8_t *data){
     _quantity = *bytes/2; //2字节
     uint8_t deltaBytes = (uint8_t)(quant*2);
@@ -391,11 +394,6 @@ uint8_t* MBPWriteCoilRegisterRequest::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPWriteCoilRegisterRequest::write(Stream& s) { //回复和请求报文一样
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)value, 2);
-}
 //回复
 uint8_t* MBPWriteCoilRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
     pBuffer = ModbusBasePack::cast(pBuffer,isNew);
@@ -410,11 +408,6 @@ uint8_t* MBPWriteCoilRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPWriteCoilRegisterResponse::write(Stream& s) { //回复和请求报文一样
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)value, 2);
-}
 
 //写单个保持寄存器0x06
 //请求
@@ -431,11 +424,6 @@ uint8_t* MBPWriteHoldingRegisterRequest::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPWriteHoldingRegisterRequest::write(Stream& s) { //回复和请求报文一样
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)value, 2);
-}
 //回复
 uint8_t* MBPWriteHoldingRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
     pBuffer = ModbusBasePack::cast(pBuffer,isNew);
@@ -450,11 +438,6 @@ uint8_t* MBPWriteHoldingRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
     }
     return pBuffer;
 }
-void MBPWriteHoldingRegisterResponse::write(Stream& s) { //回复和请求报文一样
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)value, 2);
-}
 
 //写多个线圈寄存器0x0F
 //请求
@@ -476,69 +459,20 @@ uint8_t* MBPWriteMultipleCoilRegistersRequest::cast(uint8_t *pBuffer, bool isNew
     }
     return pBuffer;
 }
-void MBPWriteMultipleCoilRegistersRequest::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-    s.write((uint8_t*)bytes, 1);
-    s.write((uint8_t*)values, *bytes);
-}
 
 void MBPWriteMultipleCoilRegistersRequest::pushRegisters(bool fromHead, uint16_t quant, uint8_t *data){
-	UNUSED(fromHead);
-	// 计算需要的字节数
     uint16_t currentQuantity = getQuantity();
-    uint8_t neededBytes = (uint8_t)((currentQuantity + quant + 7) >> 3);
-    uint8_t origBytes = *bytes;
-    uint8_t newBytes = neededBytes;
-    uint8_t *bValues = (uint8_t*)values;
-    uint8_t deltaBytes = (uint8_t)(newBytes - origBytes);
-    //从byteIndex位置插入
-    memmove(bValues + deltaBytes, bValues, origBytes);
-    memcpy(bValues, data, deltaBytes);
-    *bytes = newBytes;
+    ModbusBits::insert(values, currentQuantity, fromHead ? 0 : currentQuantity, data, quant);
     setQuantity(currentQuantity+quant);
     setEOP(((uint8_t*)values)+getBytes());
 }
 void MBPWriteMultipleCoilRegistersRequest::popRegisters(bool fromHead, uint16_t quant) {
     uint16_t totalQuantity = getQuantity();
     if (quant == 0 || totalQuantity == 0) return;
-    if (quant >= totalQuantity) {
-        *bytes = 0;
-        setQuantity(0);
-        setEOP(((uint8_t*)values)+getBytes());
-        return;
-    }
-
+    if (quant > totalQuantity) quant = totalQuantity;
     uint16_t remainQuantity = totalQuantity - quant;
-    uint8_t oldValueCount = *bytes;
-    uint8_t newValueCount = (uint8_t)((remainQuantity + 7) >> 3);
-    uint8_t *bValues = (uint8_t*)values;
-
-    if (fromHead) {  // 如果从头往后删
-        uint16_t fromByte = (uint16_t)(quant >> 3);
-        uint8_t fromBit = (uint8_t)(quant & 0x07);
-
-        if (fromBit == 0) {
-            memmove(bValues, bValues + fromByte, newValueCount);
-        } else {
-            uint8_t lShift = (uint8_t)(8 - fromBit);
-            for (uint8_t i = 0; i < newValueCount; i++) {
-                uint16_t srcIndex = (uint16_t)(i + fromByte);
-                uint8_t cur = (uint8_t)(bValues[srcIndex] >> fromBit);
-                uint8_t next = (srcIndex + 1 < oldValueCount) ? bValues[srcIndex + 1] : 0;
-                bValues[i] = (uint8_t)(cur | (uint8_t)(next << lShift));
-            }
-        }
-    }
-
-    // 清理最后一个字节的无效高位（fromHead/fromTail 通用）
-    uint8_t remainBits = (uint8_t)(remainQuantity & 0x07);
-    if (remainBits != 0 && newValueCount > 0) {
-        bValues[newValueCount - 1] &= (uint8_t)((1u << remainBits) - 1u);
-    }
-
-    *bytes = newValueCount;
+    // 从头删除时后面的位整体前移; 从尾删除只需清理新的末字节
+    ModbusBits::remove(values, totalQuantity, fromHead ? 0 : remainQuantity, quant);
     setQuantity(remainQuantity);
     setEOP(((uint8_t*)values)+getBytes());
 }
@@ -556,11 +490,6 @@ uint8_t* MBPWriteMultipleCoilRegistersResponse::cast(uint8_t *pBuffer, bool isNe
     }
     return pBuffer;
 }
-void MBPWriteMultipleCoilRegistersResponse::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-}
 void MBPWriteMultipleCoilRegistersResponse::pushRegisters(bool fromHead, uint16_t quant, uint8_t *data){
 	UNUSED(fromHead);
 	UNUSED(data);
@@ -587,13 +516,6 @@ uint8_t* MBPWriteMultipleHoldingRegistersRequest::cast(uint8_t *pBuffer, bool is
     }
     return pBuffer;
 }
-void MBPWriteMultipleHoldingRegistersRequest::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-    s.write((uint8_t*)bytes, 1);
-    s.write((uint8_t*)values, *bytes);
-}
 void MBPWriteMultipleHoldingRegistersRequest::popRegisters(bool fromHead, uint16_t quant){
     uint8_t deltaBytes = (uint8_t)(quant*2);
     uint8_t origBytes = *bytes;
@@ -639,96 +561,171 @@ uint8_t* MBPWriteMultipleHoldingRegistersResponse::cast(uint8_t *pBuffer, bool i
     }
     return pBuffer;
 }
-void MBPWriteMultipleHoldingRegistersResponse::write(Stream& s) {
-    ModbusBasePack::write(s);
-    s.write((uint8_t*)startAddress, 2);
-    s.write((uint8_t*)quantity, 2);
-}
 void MBPWriteMultipleHoldingRegistersResponse::pushRegisters(bool fromHead, uint16_t quant, uint8_t *data){
 	UNUSED(fromHead);
 	UNUSED(data);
 	setQuantity(getQuantity()+quant);
 }
 
-ModbusBasePack *ModbusBasePack::CreateModbusDiagnosePack(){
-    ModbusBasePack *mbPack = new MBPDiagnose();
+//屏蔽写保持寄存器0x16
+//请求
+uint8_t* MBPMaskWriteRegisterRequest::cast(uint8_t *pBuffer, bool isNew) {
+    pBuffer = ModbusBasePack::cast(pBuffer,isNew);
+    startAddress = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    andMask = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    orMask = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    setEOP(pBuffer);
+    if(isNew){  //Initialize Pack
+        setStartAddress(0);
+        setAndMask(0xFFFF);
+        setOrMask(0);
+    }
+    return pBuffer;
+}
+//回复
+uint8_t* MBPMaskWriteRegisterResponse::cast(uint8_t *pBuffer, bool isNew) {
+    pBuffer = ModbusBasePack::cast(pBuffer,isNew);
+    startAddress = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    andMask = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    orMask = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    setEOP(pBuffer);
+    if(isNew){  //Initialize Pack
+        setStartAddress(0);
+        setAndMask(0xFFFF);
+        setOrMask(0);
+    }
+    return pBuffer;
+}
+
+//读写多个保持寄存器0x17
+//请求
+uint8_t* MBPReadWriteMultipleRegistersRequest::cast(uint8_t *pBuffer, bool isNew) {
+    pBuffer = ModbusBasePack::cast(pBuffer,isNew);
+    readStartAddress = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    readQuantity = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    writeStartAddress = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    writeQuantity = (uint16_modbus*)(pBuffer);
+    pBuffer += sizeof(uint16_modbus);
+    bytes = pBuffer;
+    pBuffer += sizeof(uint8_t);
+    values = (uint16_modbus*)pBuffer;
+    if(isNew){  //Initialize Pack
+        setReadStartAddress(0);
+        setReadQuantity(0);
+        setWriteStartAddress(0);
+        initValues(0);
+    }else{
+        pBuffer += sizeof(uint8_t)*getBytes();
+        setEOP(pBuffer);
+    }
+    return pBuffer;
+}
+//回复 (解析与 读保持寄存器 回复一致)
+
+ModbusBasePack *ModbusBasePack::CreateModbusDiagnosePack(void *storage){
+    ModbusBasePack *mbPack = new(storage) MBPDiagnose();
     return mbPack;
 }
 
-ModbusBasePack *ModbusBasePack::CreateModbusRequestPack(uint8_t functionCode) {
+ModbusBasePack *ModbusBasePack::CreateModbusRequestPack(uint8_t functionCode, void *storage) {
     switch (functionCode) {   //功能码
     case MBPReadCoilRegisterRequest::FunctionCode: {
-        ModbusBasePack *mbPack = new MBPReadCoilRegisterRequest();
+        ModbusBasePack *mbPack = new(storage) MBPReadCoilRegisterRequest();
         return mbPack;
     }
     case MBPReadDiscreteInputRegisterRequest::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPReadDiscreteInputRegisterRequest();
+        ModbusBasePack* mbPack = new(storage) MBPReadDiscreteInputRegisterRequest();
         return mbPack;
     }
     case MBPReadHoldingRegisterRequest::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPReadHoldingRegisterRequest();
+        ModbusBasePack* mbPack = new(storage) MBPReadHoldingRegisterRequest();
         return mbPack;
     }
     case MBPReadInputRegisterRequest::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPReadInputRegisterRequest();
+        ModbusBasePack* mbPack = new(storage) MBPReadInputRegisterRequest();
         return mbPack;
     }
     case MBPWriteCoilRegisterRequest::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteCoilRegisterRequest();
+        ModbusBasePack* mbPack = new(storage) MBPWriteCoilRegisterRequest();
         return mbPack;
     }
     case MBPWriteHoldingRegisterRequest::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteHoldingRegisterRequest();
+        ModbusBasePack* mbPack = new(storage) MBPWriteHoldingRegisterRequest();
         return mbPack;
     }
     case MBPWriteMultipleCoilRegistersRequest::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteMultipleCoilRegistersRequest();
+        ModbusBasePack* mbPack = new(storage) MBPWriteMultipleCoilRegistersRequest();
         return mbPack;
     }
     case MBPWriteMultipleHoldingRegistersRequest::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteMultipleHoldingRegistersRequest();
+        ModbusBasePack* mbPack = new(storage) MBPWriteMultipleHoldingRegistersRequest();
+        return mbPack;
+    }
+    case MBPMaskWriteRegisterRequest::FunctionCode: {
+        ModbusBasePack* mbPack = new(storage) MBPMaskWriteRegisterRequest();
+        return mbPack;
+    }
+    case MBPReadWriteMultipleRegistersRequest::FunctionCode: {
+        ModbusBasePack* mbPack = new(storage) MBPReadWriteMultipleRegistersRequest();
         return mbPack;
     }
     }
     return 0;
 }
 
-ModbusBasePack *ModbusBasePack::CreateModbusResponsePack(uint8_t functionCode) {
+ModbusBasePack *ModbusBasePack::CreateModbusResponsePack(uint8_t functionCode, void *storage) {
     switch (functionCode) {   //功能码
     case MBPReadCoilRegisterResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPReadCoilRegisterResponse();
+        ModbusBasePack* mbPack = new(storage) MBPReadCoilRegisterResponse();
         return mbPack;
     }
     case MBPReadDiscreteInputRegisterResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPReadDiscreteInputRegisterResponse();
+        ModbusBasePack* mbPack = new(storage) MBPReadDiscreteInputRegisterResponse();
         return mbPack;
     }
     case MBPReadHoldingRegisterResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPReadHoldingRegisterResponse();
+        ModbusBasePack* mbPack = new(storage) MBPReadHoldingRegisterResponse();
         return mbPack;
     }
     case MBPReadInputRegisterResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPReadInputRegisterResponse();
+        ModbusBasePack* mbPack = new(storage) MBPReadInputRegisterResponse();
         return mbPack;
     }
     case MBPWriteCoilRegisterResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteCoilRegisterResponse();
+        ModbusBasePack* mbPack = new(storage) MBPWriteCoilRegisterResponse();
         return mbPack;
     }
     case MBPWriteHoldingRegisterResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteHoldingRegisterResponse();
+        ModbusBasePack* mbPack = new(storage) MBPWriteHoldingRegisterResponse();
         return mbPack;
     }
     case MBPWriteMultipleCoilRegistersResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteMultipleCoilRegistersResponse();
+        ModbusBasePack* mbPack = new(storage) MBPWriteMultipleCoilRegistersResponse();
         return mbPack;
     }
     case MBPWriteMultipleHoldingRegistersResponse::FunctionCode: {
-        ModbusBasePack* mbPack = new MBPWriteMultipleHoldingRegistersResponse();
+        ModbusBasePack* mbPack = new(storage) MBPWriteMultipleHoldingRegistersResponse();
+        return mbPack;
+    }
+    case MBPMaskWriteRegisterResponse::FunctionCode: {
+        ModbusBasePack* mbPack = new(storage) MBPMaskWriteRegisterResponse();
+        return mbPack;
+    }
+    case MBPReadWriteMultipleRegistersResponse::FunctionCode: {
+        ModbusBasePack* mbPack = new(storage) MBPReadWriteMultipleRegistersResponse();
         return mbPack;
     }
     default:{
-        ModbusBasePack* mbPack = new MBPDiagnose();
+        ModbusBasePack* mbPack = new(storage) MBPDiagnose();
         return mbPack;
     }
     }
@@ -1,9 +1,22 @@
 #pragma once
 #include <stdint.h>
 #include <string.h>
-#include "CRC16.h"
+#include <new>
+#include "ModbusPlatform.h"
+#include "ModbusCRC.h"
+#include "ModbusWords.h"
+#include "ModbusPackView.h"
 extern CRC16 gModbusCRC;
 
+/*******************************************发送钩子*******************************************/
+//一帧只调用一次钩子, 钩子可以对接writev/DMA, 一帧对应一次系统调用或一次DMA传输
+//站号+PDU+CRC在帧缓冲区里连续存放, 目前总是传一个覆盖整个ADU的段(iovCount为1), 钩子仍应按iovCount处理
+struct ModbusIOVec{
+  const uint8_t *data;
+  uint16_t length;
+};
+typedef size_t(*ModbusWriteHook)(void *context, const ModbusIOVec *iov, uint8_t iovCount);
+
 #pragma pack(push, 1) //1字节对齐
 
 /*******************************************基础数据类型*******************************************/
@@ -25,7 +38,7 @@ class ModbusBasePack{
 public:
   uint8_t *functionCode;
   uint8_t *endOfPack;
-  virtual void write(Stream &s);
+  void write(Stream &s);   //一次写出整个PDU
   virtual uint8_t *cast(uint8_t *buf, bool isNew = false);
 
   inline uint8_t getStation(){ return *(functionCode-1); }
@@ -40,55 +53,10 @@ public:
   virtual void popRegisters(bool toTail, uint16_t quant) {UNUSED(toTail); UNUSED(quant);}
   virtual bool isDiagnosePack() { return false;}
   virtual ~ModbusBasePack(){}; // 定义基类的虚析构函数，若不定义该函数，则会出现警告信息
-public: //静态
-  static ModbusBasePack* CreateModbusDiagnosePack();
-  static ModbusBasePack* CreateModbusRequestPack(uint8_t functionCode);
-  static ModbusBasePack* CreateModbusResponsePack(uint8_t functionCode);
-};
-
-/*******************************************Modbus帧*******************************************/
-class ModbusFrame {
-public:
-    ModbusFrame(CRC16 *crcmgr = 0);
-    ~ModbusFrame();
-    uint8_t* station;
-    ModbusBasePack* pack;
-    uint16_t *crc;
-    uint8_t buffer[384];
-    uint16_t validDataLength;
-    CRC16 *crcMgr;
-    uint8_t* castDiagnose(bool isNew = false);
-    uint8_t* castRequest(bool isNew = false);
-    uint8_t* castResponse(bool isNew = false);
-    uint8_t* createDiagnose(uint8_t functionCode);
-    uint8_t* createRequest(uint8_t functionCode);
-    uint8_t* createResponse(uint8_t functionCode);
-    void copy(ModbusFrame &frame, uint16_t length);
-    bool verifyCRC();
-    void applyCRC();
-    void write(Stream &s);
-    void writeRaw(Stream &s, uint16_t length);
-
-    inline uint8_t getStation(){ return *station; }
-    inline uint8_t getFunctionCode() { return *(station+1); }
-    inline uint16_t getCRC(){
-      uint8_t *pCRC = (uint8_t*)crc;
-      return (uint16_t)pCRC[0] | ((uint16_t)pCRC[1] << 8);
-    }
-    inline void setCRC(uint16_t value){
-      uint8_t *pCRC = (uint8_t*)crc;
-      pCRC[0] = (uint8_t)(value & 0xFF);
-      pCRC[1] = (uint8_t)(value >> 8);
-    }
-    inline uint8_t *getEOP() { return (pack != 0 ? pack->getEOP() : 0);}
-    
-    inline void print(Stream &s){
-      s.print("Write:");
-      s.println(pack->getSize());
-      for(uint8_t i=0;i<(pack->getSize()); i++){
-        s.println((uint16_t)(buffer[i]));
-      }
-    }
+public: //静态, 在storage上原地构造数据包(storage至少ModbusPackStorageSize字节)
+  static ModbusBasePack* CreateModbusDiagnosePack(void *storage);
+  static ModbusBasePack* CreateModbusRequestPack(uint8_t functionCode, void *storage);
+  static ModbusBasePack* CreateModbusResponsePack(uint8_t functionCode, void *storage);
 };
 
 /*485数据包必须立刻使用*/
@@ -110,7 +78,6 @@ public:
 
   uint8_t *diagnoseCode;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline void setDiagnoseCode(uint8_t code){
     *diagnoseCode = code|0x80;
   }
@@ -127,7 +94,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
@@ -142,7 +108,6 @@ public:
   uint8_t *values;
   uint16_t _quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint8_t getBytes(){ return *bytes; }
   inline void initValues(uint16_t quant){
     _quantity = quant;
@@ -181,7 +146,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
@@ -196,7 +160,6 @@ public:
   uint8_t *values;
   uint16_t _quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint8_t getBytes(){ return *bytes; }
   inline void initValues(uint16_t quant){
     _quantity = quant;
@@ -232,10 +195,10 @@ public:
 class MBPReadHoldingRegisterRequest : public ModbusBasePack{
 public:
   static const uint8_t FunctionCode = 0x03;
+  static const uint16_t MaxQuantity = 125;  //协议规定单次最多125个寄存器
   uint16_modbus *startAddress;
   uint16_modbus *quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
@@ -250,7 +213,6 @@ public:
   uint16_modbus *values;
   uint16_t _quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint8_t getBytes(){ return *bytes; }
   inline void initValues(uint16_t quant){
     *bytes = (uint8_t)(quant*2);
@@ -266,6 +228,21 @@ public:
     if(atAddress >= getBytes()/2) return 0;
     return values[atAddress].get();
   }
+  //整块读写, 只做一次边界检查, 返回实际处理的寄存器数量
+  inline uint16_t setValues(const uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::toBigEndian((uint8_t*)(values+atAddress), data, count);
+    return count;
+  }
+  inline uint16_t getValues(uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::fromBigEndian(data, (uint8_t*)(values+atAddress), count);
+    return count;
+  }
   inline void addValue(uint16_t state){
     uint16_t vIndex = _quantity;
     _quantity++;
@@ -281,10 +258,10 @@ public:
 class MBPReadInputRegisterRequest : public ModbusBasePack{
 public:
   static const uint8_t FunctionCode = 0x04;
+  static const uint16_t MaxQuantity = 125;  //协议规定单次最多125个寄存器
   uint16_modbus *startAddress;
   uint16_modbus *quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
@@ -299,7 +276,6 @@ public:
   uint16_modbus *values;
   uint16_t _quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint8_t getBytes(){ return *bytes; }
   inline void initValues(uint16_t quant){
     *bytes = (uint8_t)(quant*2);
@@ -315,6 +291,21 @@ public:
     if(atAddress >= getBytes()/2) return 0;
     return values[atAddress].get();
   }
+  //整块读写, 只做一次边界检查, 返回实际处理的寄存器数量
+  inline uint16_t setValues(const uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::toBigEndian((uint8_t*)(values+atAddress), data, count);
+    return count;
+  }
+  inline uint16_t getValues(uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::fromBigEndian(data, (uint8_t*)(values+atAddress), count);
+    return count;
+  }
   inline void addValue(uint16_t state){
     uint16_t vIndex = _quantity;
     _quantity++;
@@ -333,7 +324,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *value;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
   inline void setValue(bool data) { value->set(data?0xFF00:0x0000); }
@@ -346,7 +336,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *value;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
   inline void setValue(bool data) { value->set(data?0xFF00:0x0000); }
@@ -361,7 +350,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *value;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
   inline void setValue(uint16_t data) { value->set(data); }
@@ -374,7 +362,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *value;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
   inline void setValue(uint16_t data) { value->set(data); }
@@ -391,7 +378,6 @@ public:
   uint8_t *bytes;
   uint8_t *values;  //虽然Modbus是大端字节序，但是线圈寄存器还是按照小端排序
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
@@ -431,7 +417,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
@@ -448,8 +433,7 @@ public:
   uint16_modbus *quantity;
   uint8_t *bytes;
   uint16_modbus *values;
-  uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);  inline uint16_t getStartAddress(){ return startAddress->get(); }
+  uint8_t *cast(uint8_t *buf, bool isNew = false);  inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
   inline void setQuantity(uint16_t quant) { quantity->set(quant); *bytes = quant*2; }
@@ -468,6 +452,21 @@ public:
     if(atAddress >= getQuantity()) return 0;
     return values[atAddress].get();
   }
+  //整块读写, 只做一次边界检查, 返回实际处理的寄存器数量
+  inline uint16_t setValues(const uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::toBigEndian((uint8_t*)(values+atAddress), data, count);
+    return count;
+  }
+  inline uint16_t getValues(uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::fromBigEndian(data, (uint8_t*)(values+atAddress), count);
+    return count;
+  }
   inline void addValue(uint16_t state){
     uint16_t vIndex = getQuantity();
     setQuantity(vIndex+1);
@@ -484,7 +483,6 @@ public:
   uint16_modbus *startAddress;
   uint16_modbus *quantity;
   uint8_t *cast(uint8_t *buf, bool isNew = false);
-  void write(Stream &s);
   inline uint16_t getStartAddress(){ return startAddress->get(); }
   inline uint16_t getQuantity(){ return quantity->get(); }
   inline void setStartAddress(uint16_t address) { startAddress->set(address); }
@@ -492,5 +490,186 @@ public:
   void pushRegisters(bool toTail, uint16_t quant, uint8_t *data);
 };
 
+/****************屏蔽写保持寄存器0x16****************/
+//结果 = (当前值 AND andMask) OR (orMask AND (NOT andMask))
+//请求
+class MBPMaskWriteRegisterRequest : public ModbusBasePack{
+public:
+  static const uint8_t FunctionCode = 0x16;
+  uint16_modbus *startAddress;
+  uint16_modbus *andMask;
+  uint16_modbus *orMask;
+  uint8_t *cast(uint8_t *buf, bool isNew = false);
+  inline uint16_t getStartAddress(){ return startAddress->get(); }
+  inline void setStartAddress(uint16_t address) { startAddress->set(address); }
+  inline uint16_t getAndMask() { return andMask->get(); }
+  inline void setAndMask(uint16_t mask) { andMask->set(mask); }
+  inline uint16_t getOrMask() { return orMask->get(); }
+  inline void setOrMask(uint16_t mask) { orMask->set(mask); }
+  inline uint16_t apply(uint16_t current) { return (current & getAndMask()) | (getOrMask() & ~getAndMask()); }
+};
+//回复 ( 与请求报文一样 )
+class MBPMaskWriteRegisterResponse : public ModbusBasePack{
+public:
+  static const uint8_t FunctionCode = 0x16;
+  uint16_modbus *startAddress;
+  uint16_modbus *andMask;
+  uint16_modbus *orMask;
+  uint8_t *cast(uint8_t *buf, bool isNew = false);
+  inline uint16_t getStartAddress(){ return startAddress->get(); }
+  inline void setStartAddress(uint16_t address) { startAddress->set(address); }
+  inline uint16_t getAndMask() { return andMask->get(); }
+  inline void setAndMask(uint16_t mask) { andMask->set(mask); }
+  inline uint16_t getOrMask() { return orMask->get(); }
+  inline void setOrMask(uint16_t mask) { orMask->set(mask); }
+  inline uint16_t apply(uint16_t current) { return (current & getAndMask()) | (getOrMask() & ~getAndMask()); }
+};
+
+/****************读写多个保持寄存器0x17****************/
+//请求 (先写后读)
+class MBPReadWriteMultipleRegistersRequest : public ModbusBasePack{
+public:
+  static const uint8_t FunctionCode = 0x17;
+  static const uint16_t MaxReadQuantity = 125;  //协议规定最多读125个寄存器
+  static const uint16_t MaxWriteQuantity = 121; //协议规定最多写121个寄存器
+  uint16_modbus *readStartAddress;
+  uint16_modbus *readQuantity;
+  uint16_modbus *writeStartAddress;
+  uint16_modbus *writeQuantity;
+  uint8_t *bytes;
+  uint16_modbus *values;  //写入的数据
+  uint8_t *cast(uint8_t *buf, bool isNew = false);
+  inline uint16_t getReadStartAddress(){ return readStartAddress->get(); }
+  inline uint16_t getReadQuantity(){ return readQuantity->get(); }
+  inline uint16_t getWriteStartAddress(){ return writeStartAddress->get(); }
+  inline uint16_t getWriteQuantity(){ return writeQuantity->get(); }
+  inline void setReadStartAddress(uint16_t address) { readStartAddress->set(address); }
+  inline void setReadQuantity(uint16_t quant) { readQuantity->set(quant); }
+  inline void setWriteStartAddress(uint16_t address) { writeStartAddress->set(address); }
+  inline void setWriteQuantity(uint16_t quant) { writeQuantity->set(quant); *bytes = (uint8_t)(quant*2); }
+  inline uint8_t getBytes(){ return *bytes; }
+  inline void initValues(uint16_t quant){
+    setWriteQuantity(quant);
+    memset((uint8_t*)values, 0, *bytes);
+    setEOP(((uint8_t*)values)+getBytes());
+  }
+  inline void setValue(uint8_t atAddress, uint16_t data) { 
+    if(atAddress >= getBytes()/2) return;
+    values[atAddress].set(data);
+  }
+  inline uint16_t getValue(uint8_t atAddress){
+    if(atAddress >= getBytes()/2) return 0;
+    return values[atAddress].get();
+  }
+  inline uint16_t setValues(const uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::toBigEndian((uint8_t*)(values+atAddress), data, count);
+    return count;
+  }
+  inline uint16_t getValues(uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::fromBigEndian(data, (uint8_t*)(values+atAddress), count);
+    return count;
+  }
+  inline void addValue(uint16_t state){
+    uint16_t vIndex = getWriteQuantity();
+    setWriteQuantity(vIndex+1);
+    setValue(vIndex,state);
+    setEOP(((uint8_t*)values)+getBytes());
+  }
+};
+//回复 (与 读保持寄存器 回复一致)
+class MBPReadWriteMultipleRegistersResponse : public MBPReadHoldingRegisterResponse{
+public:
+  static const uint8_t FunctionCode = 0x17;
+};
+
 #pragma pack(pop)
 
+/*******************************************数据包原地存储*******************************************/
+//编译期计算所有数据包类型中最大的尺寸, ModbusFrame按此大小预留存储, 解析和组包时不再new/delete
+template<typename T, typename... Rest>
+struct ModbusPackMaxSize{
+  static constexpr size_t value = sizeof(T) > ModbusPackMaxSize<Rest...>::value ? sizeof(T) : ModbusPackMaxSize<Rest...>::value;
+};
+template<typename T>
+struct ModbusPackMaxSize<T>{
+  static constexpr size_t value = sizeof(T);
+};
+static constexpr size_t ModbusPackStorageSize = ModbusPackMaxSize<
+  MBPDiagnose,
+  MBPReadCoilRegisterRequest, MBPReadCoilRegisterResponse,
+  MBPReadDiscreteInputRegisterRequest, MBPReadDiscreteInputRegisterResponse,
+  MBPReadHoldingRegisterRequest, MBPReadHoldingRegisterResponse,
+  MBPReadInputRegisterRequest, MBPReadInputRegisterResponse,
+  MBPWriteCoilRegisterRequest, MBPWriteCoilRegisterResponse,
+  MBPWriteHoldingRegisterRequest, MBPWriteHoldingRegisterResponse,
+  MBPWriteMultipleCoilRegistersRequest, MBPWriteMultipleCoilRegistersResponse,
+  MBPWriteMultipleHoldingRegistersRequest, MBPWriteMultipleHoldingRegistersResponse,
+  MBPMaskWriteRegisterRequest, MBPMaskWriteRegisterResponse,
+  MBPReadWriteMultipleRegistersRequest, MBPReadWriteMultipleRegistersResponse
+>::value;
+
+/*******************************************Modbus帧*******************************************/
+class ModbusFrame {
+public:
+    ModbusFrame(CRC16 *crcmgr = 0);
+    ~ModbusFrame();
+    uint8_t* station;
+    ModbusBasePack* pack;   //指向packStorage, 不在堆上分配
+    uint16_t *crc;
+    uint8_t buffer[384];
+    uint16_t validDataLength;
+    CRC16 *crcMgr;
+    uint8_t* castDiagnose(bool isNew = false);
+    uint8_t* castRequest(bool isNew = false);
+    uint8_t* castResponse(bool isNew = false);
+    uint8_t* createDiagnose(uint8_t functionCode);
+    uint8_t* createRequest(uint8_t functionCode);
+    uint8_t* createResponse(uint8_t functionCode);
+    void copy(ModbusFrame &frame, uint16_t length);
+    uint16_t expectedRequestLength(uint16_t received);
+    uint16_t expectedResponseLength(uint16_t received);
+    uint16_t calcCRC(uint16_t length);
+    bool verifyCRC();
+    bool verifyCRC(uint16_t rxResidue);
+    void applyCRC();
+    void write(Stream &s);
+    void write(ModbusWriteHook hook, void *context);
+    void writeRaw(Stream &s, uint16_t length);
+    void writeRaw(ModbusWriteHook hook, void *context, uint16_t length);
+
+    inline uint8_t getStation(){ return *station; }
+    inline uint8_t getFunctionCode() { return *(station+1); }
+    inline uint16_t getCRC(){
+      uint8_t *pCRC = (uint8_t*)crc;
+      return (uint16_t)pCRC[0] | ((uint16_t)pCRC[1] << 8);
+    }
+    inline void setCRC(uint16_t value){
+      uint8_t *pCRC = (uint8_t*)crc;
+      pCRC[0] = (uint8_t)(value & 0xFF);
+      pCRC[1] = (uint8_t)(value >> 8);
+    }
+    inline uint8_t *getEOP() { return (pack != 0 ? pack->getEOP() : 0);}
+    inline uint16_t getFrameLength(){ return (uint16_t)(pack->getSize() + sizeof(uint16_t)); }   //站号+PDU+CRC
+    //按功能码类型直接查看缓冲区, 不需要先cast, 例如 frame.view<MBVReadHoldingRegisterRequest>()
+    template<typename View>
+    inline View view(){ return View(buffer+1); }
+    
+    inline void print(Stream &s){
+      s.print("Write:");
+      s.println(pack->getSize());
+      for(uint8_t i=0;i<(pack->getSize()); i++){
+        s.println((uint16_t)(buffer[i]));
+      }
+    }
+private:
+    void releasePack();
+    alignas(8) uint8_t packStorage[ModbusPackStorageSize];  //数据包原地存储, 大小为最大的数据包
+};
+
+
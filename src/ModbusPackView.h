@@ -0,0 +1,235 @@
+#pragma once
+#include <stdint.h>
+#include "ModbusWords.h"
+
+/*******************************************数据包视图*******************************************/
+//视图直接在帧缓冲区上读写字段, 没有虚函数, 也不保存字段指针
+//字段偏移在编译期确定, 所有访问器都可以内联, 视图本身只有一个指针大小, 按值传递即可
+//pdu指向功能码(即ModbusFrame::buffer+1)
+class MBVBase{
+public:
+  uint8_t *pdu;
+  explicit MBVBase(uint8_t *p) : pdu(p) {}
+  inline uint8_t getStation() const { return pdu[-1]; }
+  inline uint8_t getFunctionCode() const { return pdu[0]; }
+protected:
+  inline uint16_t getU16(uint16_t offset) const { return (uint16_t)((pdu[offset] << 8) | pdu[offset+1]); }
+  inline void setU16(uint16_t offset, uint16_t value){
+    pdu[offset] = (uint8_t)(value >> 8);
+    pdu[offset+1] = (uint8_t)(value & 0xFF);
+  }
+  inline bool getBit(uint16_t offset, uint16_t bytes, uint16_t atAddress) const {
+    uint16_t bitBlock = atAddress >> 3;
+    if(bitBlock >= bytes) return 0;
+    return (pdu[offset+bitBlock] >> (atAddress & 0x07)) & 0x01;
+  }
+  inline void setBit(uint16_t offset, uint16_t bytes, uint16_t atAddress, bool state){
+    uint16_t bitBlock = atAddress >> 3;
+    if(bitBlock >= bytes) return;
+    uint8_t bitIndex = atAddress & 0x07;
+    pdu[offset+bitBlock] = (uint8_t)((pdu[offset+bitBlock] & ~(1 << bitIndex)) | (state << bitIndex));
+  }
+};
+
+/****************诊断包0x80+功能码****************/
+class MBVDiagnose : public MBVBase{
+public:
+  static const uint8_t FunctionCode = 0x80;
+  explicit MBVDiagnose(uint8_t *p) : MBVBase(p) {}
+  inline uint8_t getDiagnoseCode() const { return pdu[1]; }
+  inline void setDiagnoseCode(uint8_t code){ pdu[1] = code; }
+  inline uint16_t getSize() const { return 2; }
+};
+
+/****************起始地址+数量 (0x01~0x04请求, 0x0F/0x10回复)****************/
+template<uint8_t FC>
+class MBVAddressQuantity : public MBVBase{
+public:
+  static const uint8_t FunctionCode = FC;
+  explicit MBVAddressQuantity(uint8_t *p) : MBVBase(p) {}
+  inline uint16_t getStartAddress() const { return getU16(1); }
+  inline uint16_t getQuantity() const { return getU16(3); }
+  inline void setStartAddress(uint16_t address){ setU16(1, address); }
+  inline void setQuantity(uint16_t quant){ setU16(3, quant); }
+  inline uint16_t getSize() const { return 5; }
+};
+
+/****************单个线圈 (0x05请求和回复)****************/
+template<uint8_t FC>
+class MBVSingleCoil : public MBVBase{
+public:
+  static const uint8_t FunctionCode = FC;
+  explicit MBVSingleCoil(uint8_t *p) : MBVBase(p) {}
+  inline uint16_t getStartAddress() const { return getU16(1); }
+  inline void setStartAddress(uint16_t address){ setU16(1, address); }
+  inline bool getValue() const { return getU16(3) == 0xFF00; }
+  inline void setValue(bool data){ setU16(3, data?0xFF00:0x0000); }
+  inline uint16_t getRawValue() const { return getU16(3); }
+  inline uint16_t getSize() const { return 5; }
+};
+
+/****************单个保持寄存器 (0x06请求和回复)****************/
+template<uint8_t FC>
+class MBVSingleRegister : public MBVBase{
+public:
+  static const uint8_t FunctionCode = FC;
+  explicit MBVSingleRegister(uint8_t *p) : MBVBase(p) {}
+  inline uint16_t getStartAddress() const { return getU16(1); }
+  inline void setStartAddress(uint16_t address){ setU16(1, address); }
+  inline uint16_t getValue() const { return getU16(3); }
+  inline void setValue(uint16_t data){ setU16(3, data); }
+  inline uint16_t getSize() const { return 5; }
+};
+
+/****************字节数+位数据 (0x01/0x02回复)****************/
+template<uint8_t FC>
+class MBVBitsResponse : public MBVBase{
+public:
+  static const uint8_t FunctionCode = FC;
+  explicit MBVBitsResponse(uint8_t *p) : MBVBase(p) {}
+  inline uint8_t getBytes() const { return pdu[1]; }
+  inline uint8_t *getValues() const { return pdu+2; }
+  inline bool getValue(uint16_t atAddress) const { return getBit(2, getBytes(), atAddress); }
+  inline void setValue(uint16_t atAddress, bool state){ setBit(2, getBytes(), atAddress, state); }
+  inline uint16_t getSize() const { return 2+getBytes(); }
+};
+
+/****************字节数+字数据 (0x03/0x04回复)****************/
+template<uint8_t FC>
+class MBVWordsResponse : public MBVBase{
+public:
+  static const uint8_t FunctionCode = FC;
+  explicit MBVWordsResponse(uint8_t *p) : MBVBase(p) {}
+  inline uint8_t getBytes() const { return pdu[1]; }
+  inline uint8_t *getValues() const { return pdu+2; }
+  inline uint16_t getValue(uint16_t atAddress) const {
+    if(atAddress >= getBytes()/2) return 0;
+    return getU16(2+atAddress*2);
+  }
+  inline void setValue(uint16_t atAddress, uint16_t data){
+    if(atAddress >= getBytes()/2) return;
+    setU16(2+atAddress*2, data);
+  }
+  inline uint16_t setValues(const uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::toBigEndian(pdu+2+atAddress*2, data, count);
+    return count;
+  }
+  inline uint16_t getValues(uint16_t *data, uint16_t count, uint16_t atAddress = 0) const {
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::fromBigEndian(data, pdu+2+atAddress*2, count);
+    return count;
+  }
+  inline uint16_t getSize() const { return 2+getBytes(); }
+};
+
+/****************写多个线圈请求0x0F****************/
+class MBVWriteMultipleCoilRegistersRequest : public MBVBase{
+public:
+  static const uint8_t FunctionCode = 0x0F;
+  explicit MBVWriteMultipleCoilRegistersRequest(uint8_t *p) : MBVBase(p) {}
+  inline uint16_t getStartAddress() const { return getU16(1); }
+  inline uint16_t getQuantity() const { return getU16(3); }
+  inline uint8_t getBytes() const { return pdu[5]; }
+  inline uint8_t *getValues() const { return pdu+6; }
+  inline bool getValue(uint16_t atAddress) const { return getBit(6, getBytes(), atAddress); }
+  inline void setValue(uint16_t atAddress, bool state){ setBit(6, getBytes(), atAddress, state); }
+  inline uint16_t getSize() const { return 6+getBytes(); }
+};
+
+/****************写多个保持寄存器请求0x10****************/
+class MBVWriteMultipleHoldingRegistersRequest : public MBVBase{
+public:
+  static const uint8_t FunctionCode = 0x10;
+  explicit MBVWriteMultipleHoldingRegistersRequest(uint8_t *p) : MBVBase(p) {}
+  inline uint16_t getStartAddress() const { return getU16(1); }
+  inline uint16_t getQuantity() const { return getU16(3); }
+  inline uint8_t getBytes() const { return pdu[5]; }
+  inline uint8_t *getValues() const { return pdu+6; }
+  inline uint16_t getValue(uint16_t atAddress) const {
+    if(atAddress >= getQuantity()) return 0;
+    return getU16(6+atAddress*2);
+  }
+  inline void setValue(uint16_t atAddress, uint16_t data){
+    if(atAddress >= getQuantity()) return;
+    setU16(6+atAddress*2, data);
+  }
+  inline uint16_t setValues(const uint16_t *data, uint16_t count, uint16_t atAddress = 0){
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::toBigEndian(pdu+6+atAddress*2, data, count);
+    return count;
+  }
+  inline uint16_t getValues(uint16_t *data, uint16_t count, uint16_t atAddress = 0) const {
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::fromBigEndian(data, pdu+6+atAddress*2, count);
+    return count;
+  }
+  inline uint16_t getSize() const { return 6+getBytes(); }
+};
+
+/****************屏蔽写保持寄存器 (0x16请求和回复)****************/
+template<uint8_t FC>
+class MBVMaskWriteRegister : public MBVBase{
+public:
+  static const uint8_t FunctionCode = FC;
+  explicit MBVMaskWriteRegister(uint8_t *p) : MBVBase(p) {}
+  inline uint16_t getStartAddress() const { return getU16(1); }
+  inline void setStartAddress(uint16_t address){ setU16(1, address); }
+  inline uint16_t getAndMask() const { return getU16(3); }
+  inline void setAndMask(uint16_t mask){ setU16(3, mask); }
+  inline uint16_t getOrMask() const { return getU16(5); }
+  inline void setOrMask(uint16_t mask){ setU16(5, mask); }
+  inline uint16_t apply(uint16_t current) const { return (current & getAndMask()) | (getOrMask() & ~getAndMask()); }
+  inline uint16_t getSize() const { return 7; }
+};
+
+/****************读写多个保持寄存器请求0x17****************/
+class MBVReadWriteMultipleRegistersRequest : public MBVBase{
+public:
+  static const uint8_t FunctionCode = 0x17;
+  explicit MBVReadWriteMultipleRegistersRequest(uint8_t *p) : MBVBase(p) {}
+  inline uint16_t getReadStartAddress() const { return getU16(1); }
+  inline uint16_t getReadQuantity() const { return getU16(3); }
+  inline uint16_t getWriteStartAddress() const { return getU16(5); }
+  inline uint16_t getWriteQuantity() const { return getU16(7); }
+  inline uint8_t getBytes() const { return pdu[9]; }
+  inline uint8_t *getValues() const { return pdu+10; }
+  inline uint16_t getValue(uint16_t atAddress) const {
+    if(atAddress >= getBytes()/2) return 0;
+    return getU16(10+atAddress*2);
+  }
+  inline uint16_t getValues(uint16_t *data, uint16_t count, uint16_t atAddress = 0) const {
+    uint16_t total = getBytes()/2;
+    if(atAddress >= total) return 0;
+    if(count > total-atAddress) count = total-atAddress;
+    ModbusWords::fromBigEndian(data, pdu+10+atAddress*2, count);
+    return count;
+  }
+  inline uint16_t getSize() const { return 10+getBytes(); }
+};
+
+typedef MBVAddressQuantity<0x01> MBVReadCoilRegisterRequest;
+typedef MBVBitsResponse<0x01> MBVReadCoilRegisterResponse;
+typedef MBVAddressQuantity<0x02> MBVReadDiscreteInputRegisterRequest;
+typedef MBVBitsResponse<0x02> MBVReadDiscreteInputRegisterResponse;
+typedef MBVAddressQuantity<0x03> MBVReadHoldingRegisterRequest;
+typedef MBVWordsResponse<0x03> MBVReadHoldingRegisterResponse;
+typedef MBVAddressQuantity<0x04> MBVReadInputRegisterRequest;
+typedef MBVWordsResponse<0x04> MBVReadInputRegisterResponse;
+typedef MBVSingleCoil<0x05> MBVWriteCoilRegisterRequest;
+typedef MBVSingleCoil<0x05> MBVWriteCoilRegisterResponse;
+typedef MBVSingleRegister<0x06> MBVWriteHoldingRegisterRequest;
+typedef MBVSingleRegister<0x06> MBVWriteHoldingRegisterResponse;
+typedef MBVAddressQuantity<0x0F> MBVWriteMultipleCoilRegistersResponse;
+typedef MBVAddressQuantity<0x10> MBVWriteMultipleHoldingRegistersResponse;
+typedef MBVMaskWriteRegister<0x16> MBVMaskWriteRegisterRequest;
+typedef MBVMaskWriteRegister<0x16> MBVMaskWriteRegisterResponse;
+typedef MBVWordsResponse<0x17> MBVReadWriteMultipleRegistersResponse;
@@ -0,0 +1,101 @@
+#include "ModbusPipeline.h"
+/* 从站接收/处理流水线 */
+#if defined(__linux__) || defined(ESP32)
+
+ModbusSlavePipeline::ModbusSlavePipeline(){
+  onRequest = 0;
+  userData = 0;
+  droppedFrames = 0;
+  replyDeadlineUs = 0;
+  expiredResponses = 0;
+  processingPollUs = 1000;
+  slave = 0;
+  slots = 0;
+  slotCount = 0;
+  freeCount = 0;
+  pendingIndex = NoSlot;
+}
+
+bool ModbusSlavePipeline::begin(ModbusRS485Slave &argSlave, ModbusPipelineSlot *slotPool, uint8_t argSlotCount){
+  if(slotPool == 0 || argSlotCount == 0 || argSlotCount > MaxSlots) return false;
+  slave = &argSlave;
+  slots = slotPool;
+  slotCount = argSlotCount;
+  requestQueue.clear();
+  responseQueue.clear();
+  for(uint8_t i=0; i<slotCount; i++) freeSlots[i] = i;
+  freeCount = slotCount;
+  pendingIndex = NoSlot;
+  slave->onReceived = onSlaveReceived;
+  slave->userData = this;
+  return true;
+}
+
+//回复按处理完成的顺序发送: 总线上正在接收下一帧或回复延时未到时留在pendingIndex, 下次再发
+uint32_t ModbusSlavePipeline::updateIO(){
+  uint32_t deadline = slave->update();
+  uint32_t now = slave->getTransport()->micros();
+  while(pendingIndex != NoSlot || responseQueue.pop(pendingIndex)){
+    ModbusPipelineSlot &slot = slots[pendingIndex];
+    if(slot.responseLength && replyDeadlineUs && now - slot.receivedTick > replyDeadlineUs){
+      expiredResponses ++;
+      slot.responseLength = 0;
+    }
+    if(slot.responseLength){
+      if(slave->state != ModbusRS485::WaitStation) break;  //不能打断正在接收的帧
+      uint32_t elapsed = now - slot.receivedTick;
+      if(elapsed <= slave->sendBackDelay){  //和isSendBackDelayComplete一致
+        uint32_t remaining = slave->sendBackDelay - elapsed + 1;
+        if(remaining < deadline) deadline = remaining;
+        break;
+      }
+      memcpy(slave->txFrame.buffer, slot.response.buffer, slot.responseLength);
+      slave->transmitRaw(slot.responseLength);
+      now = slave->getTransport()->micros();
+    }
+    freeSlots[freeCount++] = pendingIndex;
+    pendingIndex = NoSlot;
+  }
+  uint8_t processing = (uint8_t)(slotCount - freeCount - (pendingIndex != NoSlot ? 1 : 0));  //排队或处理中, 回复随时会进responseQueue
+  if(processing && processingPollUs < deadline) deadline = processingPollUs;
+  return deadline;
+}
+
+bool ModbusSlavePipeline::process(){
+  uint8_t index;
+  if(!requestQueue.pop(index)) return false;
+  ModbusPipelineSlot &slot = slots[index];
+  slot.responseLength = 0;
+  bool reply = slot.request.castRequest() && onRequest && onRequest(this, slot.request, slot.response) && slot.response.pack;
+  if(reply && slot.request.getStation() != ModbusRS485::BroadcastStation){  //广播只执行不回复
+    *(slot.response.station) = slot.request.getStation();
+    slot.response.applyCRC();
+    slot.responseLength = slot.response.getFrameLength();
+  }
+  responseQueue.push(index);  //槽位总数不超过队列容量, 不会失败
+  return true;
+}
+
+void ModbusSlavePipeline::onSlaveReceived(ModbusRS485 *modbusController){
+  ((ModbusSlavePipeline*)modbusController->userData)->enqueue();
+}
+
+//在IO线程上只做校验和拷贝, 处理交给处理线程
+void ModbusSlavePipeline::enqueue(){
+  slave->processPack();
+  if(slave->failType != ModbusRS485::RcvNoFail) return;
+  if(!slave->isAddressed()) return;  //不是发给本站的, 也不是广播写
+  if(freeCount == 0){
+    droppedFrames ++;
+    return;
+  }
+  uint8_t index = freeSlots[--freeCount];
+  ModbusPipelineSlot &slot = slots[index];
+  uint16_t length = slave->rxFrame.validDataLength;
+  slot.request.copy(slave->rxFrame, length);
+  slot.request.validDataLength = length;
+  slot.receivedTick = slave->lastTick;
+  requestQueue.push(index);
+}
+
+#endif
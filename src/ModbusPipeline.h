@@ -0,0 +1,89 @@
+#pragma once
+#include "Modbus.h"
+
+//接收和处理分在两个线程/任务上, 需要std::atomic, 仅在多核平台(Linux、ESP32)上可用
+#if defined(__linux__) || defined(ESP32)
+#include <atomic>
+
+/*******************************************单生产者单消费者无锁队列*******************************************/
+//只传递槽位序号, 一端只push、另一端只pop时不需要加锁
+template<uint16_t Capacity>
+class ModbusSPSCQueue{
+public:
+  static_assert((Capacity & (Capacity - 1)) == 0 && Capacity <= 256, "Capacity must be a power of two <= 256");
+  ModbusSPSCQueue() : head(0), tail(0) {}
+  inline bool push(uint8_t value){
+    uint16_t t = tail.load(std::memory_order_relaxed);
+    if((uint16_t)(t - head.load(std::memory_order_acquire)) >= Capacity) return false;
+    items[t & (Capacity - 1)] = value;
+    tail.store((uint16_t)(t + 1), std::memory_order_release);  //写入的槽位内容对消费者可见
+    return true;
+  }
+  inline bool pop(uint8_t &value){
+    uint16_t h = head.load(std::memory_order_relaxed);
+    if(h == tail.load(std::memory_order_acquire)) return false;
+    value = items[h & (Capacity - 1)];
+    head.store((uint16_t)(h + 1), std::memory_order_release);
+    return true;
+  }
+  inline uint16_t size(){ return (uint16_t)(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire)); }
+  inline void clear(){ head.store(0); tail.store(0); }
+private:
+  alignas(64) std::atomic<uint16_t> head;  //消费者和生产者的位置放在不同的缓存行
+  alignas(64) std::atomic<uint16_t> tail;
+  uint8_t items[Capacity];
+};
+
+/*******************************************从站接收/处理流水线*******************************************/
+//一个请求和它的回复, 由用户提供的数组分配, 同一时刻只属于一个阶段
+class ModbusPipelineSlot{
+public:
+  ModbusFrame request;
+  ModbusFrame response;
+  uint16_t responseLength;  //0表示不回复
+  uint32_t receivedTick;    //请求最后一个字节的时间, 回复延时和期限从这里算
+};
+
+class ModbusSlavePipeline;
+//在处理线程上调用, 返回true时发送response
+typedef bool (*ModbusPipelineCallback)(ModbusSlavePipeline *pipeline, ModbusFrame &request, ModbusFrame &response);
+
+//IO线程: updateIO()接收帧放进槽位, 发送处理好的回复, 只有它访问串口
+//处理线程: process()取出请求调用onRequest(寄存器处理、应用逻辑), 慢的回调不再耽误接收
+//例: std::thread([&]{ while(run){ if(!pipeline.process()) std::this_thread::yield(); } });
+//    IO线程: while(run){ slave.wait(pipeline.updateIO()); }
+//    处理线程没有唤醒IO线程的手段: 有请求在排队或处理中时updateIO()最多返回processingPollUs, 回复最多晚这么久发出
+class ModbusSlavePipeline{
+public:
+  static const uint8_t MaxSlots = 64;
+
+  ModbusPipelineCallback onRequest;
+  void *userData;
+  uint32_t droppedFrames;  //没有空闲槽位而丢弃的请求, 只在IO线程上修改
+  uint32_t replyDeadlineUs;   //处理太慢时回复超过这个时间就不再发送(主站早已超时), 0表示不限
+  uint32_t expiredResponses;  //因超过replyDeadlineUs而丢弃的回复, 只在IO线程上修改
+  uint32_t processingPollUs;  //有请求在处理线程上时IO线程检查回复的间隔, 默认1000
+
+  ModbusSlavePipeline();
+  bool begin(ModbusRS485Slave &argSlave, ModbusPipelineSlot *slotPool, uint8_t slotCount);
+  uint32_t updateIO();  //IO线程调用, 返回到下一个期限(帧间隔、回复延时或processingPollUs)的微秒数
+  bool process();       //处理线程调用, 处理了一个请求返回true
+  inline uint16_t getPendingRequests(){ return requestQueue.size(); }
+  inline ModbusRS485Slave *getSlave(){ return slave; }
+private:
+  ModbusRS485Slave *slave;
+  ModbusPipelineSlot *slots;
+  uint8_t slotCount;
+  ModbusSPSCQueue<MaxSlots> requestQueue;   //IO -> 处理
+  ModbusSPSCQueue<MaxSlots> responseQueue;  //处理 -> IO
+  uint8_t freeSlots[MaxSlots];  //空闲槽位, 只有IO线程访问
+  uint8_t freeCount;
+  uint8_t pendingIndex;  //已处理完但还不能发送的回复, 只有IO线程访问
+
+  static const uint8_t NoSlot = 0xFF;
+
+  static void onSlaveReceived(ModbusRS485 *modbusController);
+  void enqueue();
+};
+
+#endif
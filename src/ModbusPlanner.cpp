@@ -0,0 +1,118 @@
+#include "ModbusPlanner.h"
+/* 读请求合并 */
+
+ModbusReadPlanner::ModbusReadPlanner(){
+  maxGap = 0;
+  items = 0;
+  order = 0;
+  requests = 0;
+  requestCount = 0;
+}
+
+bool ModbusReadPlanner::isBefore(ModbusReadItem &a, ModbusReadItem &b){
+  if(a.station != b.station) return a.station < b.station;
+  if(a.functionCode != b.functionCode) return a.functionCode < b.functionCode;
+  return a.address < b.address;
+}
+
+//按(站号, 功能码, 地址)排序后顺序扫描, 下一段离当前请求末尾不超过maxGap且总长度不超限时并入
+uint16_t ModbusReadPlanner::plan(ModbusReadItem *argItems, uint16_t itemCount, uint16_t *argOrder, ModbusReadRequest *argRequests, uint16_t maxRequests){
+  requestCount = 0;
+  if(argItems == 0 || argOrder == 0 || argRequests == 0) return 0;
+  for(uint16_t i=0; i<itemCount; i++){
+    ModbusReadItem &item = argItems[i];
+    if(item.functionCode < 0x01 || item.functionCode > 0x04) return 0;
+    if(item.quantity == 0 || item.quantity > getLimit(item.functionCode)) return 0;
+    if(item.isBits() ? item.bits == 0 : item.words == 0) return 0;
+    if((uint32_t)item.address + item.quantity > 0x10000) return 0;
+  }
+  items = argItems;
+  order = argOrder;
+  requests = argRequests;
+  for(uint16_t i=0; i<itemCount; i++){  //插入排序, 点表通常只有几十项
+    uint16_t index = i;
+    uint16_t j = i;
+    while(j > 0 && isBefore(items[index], items[order[j-1]])){
+      order[j] = order[j-1];
+      j --;
+    }
+    order[j] = index;
+  }
+  for(uint16_t i=0; i<itemCount; i++){
+    ModbusReadItem &item = items[order[i]];
+    uint32_t itemEnd = (uint32_t)item.address + item.quantity;
+    if(requestCount > 0){
+      ModbusReadRequest &current = requests[requestCount-1];
+      uint32_t currentEnd = (uint32_t)current.startAddress + current.quantity;
+      uint32_t end = itemEnd > currentEnd ? itemEnd : currentEnd;
+      if(current.station == item.station && current.functionCode == item.functionCode
+        && item.address <= currentEnd + maxGap && end - current.startAddress <= getLimit(item.functionCode)){
+        current.quantity = (uint16_t)(end - current.startAddress);
+        current.itemCount ++;
+        continue;
+      }
+    }
+    if(requestCount >= maxRequests){
+      requestCount = 0;
+      return 0;
+    }
+    ModbusReadRequest &request = requests[requestCount++];
+    request.station = item.station;
+    request.functionCode = item.functionCode;
+    request.startAddress = item.address;
+    request.quantity = item.quantity;
+    request.firstItem = i;
+    request.itemCount = 1;
+  }
+  return requestCount;
+}
+
+void ModbusReadPlanner::buildRequest(ModbusReadRequest &request, ModbusFrame &frame){
+  frame.createRequest(request.functionCode);
+  MBVReadHoldingRegisterRequest pack = frame.view<MBVReadHoldingRegisterRequest>();  //0x01~0x04请求布局相同
+  pack.setStartAddress(request.startAddress);
+  pack.setQuantity(request.quantity);
+}
+
+//校验回复属于这个请求且长度正确, 再按各点的偏移拆分; 失败时每个点都记录原因
+bool ModbusReadPlanner::applyResponse(ModbusReadRequest &request, ModbusFrame &frame, uint8_t failType){
+  uint8_t exceptionCode = 0;
+  if(failType == ModbusRS485::RcvNoFail){
+    bool isBits = request.functionCode == 0x01 || request.functionCode == 0x02;
+    uint16_t expectedBytes = isBits ? (uint16_t)((request.quantity + 7) >> 3) : (uint16_t)(request.quantity * 2);
+    if(frame.getStation() != request.station){
+      failType = ModbusRS485::RcvVerifyFailed;
+    }else if(frame.getFunctionCode() == (request.functionCode | MBPDiagnose::FunctionCode)){
+      exceptionCode = frame.view<MBVDiagnose>().getDiagnoseCode();
+    }else if(frame.getFunctionCode() != request.functionCode || frame.buffer[2] != expectedBytes){
+      failType = ModbusRS485::RcvVerifyFailed;
+    }
+  }
+  bool success = failType == ModbusRS485::RcvNoFail && exceptionCode == 0;
+  for(uint16_t i=0; i<request.itemCount; i++){
+    ModbusReadItem &item = *getItem(request, i);
+    item.failType = failType;
+    item.exceptionCode = exceptionCode;
+    if(!success) continue;
+    uint16_t offset = item.address - request.startAddress;
+    if(item.isBits()){
+      MBVReadCoilRegisterResponse pack = frame.view<MBVReadCoilRegisterResponse>();  //0x01/0x02回复布局相同
+      for(uint16_t k=0; k<item.quantity; k++) item.bits[k] = pack.getValue(offset + k);
+    }else{
+      MBVReadHoldingRegisterResponse pack = frame.view<MBVReadHoldingRegisterResponse>();  //0x03/0x04回复布局相同
+      pack.getValues(item.words, item.quantity, offset);
+    }
+    item.updates ++;
+  }
+  return success;
+}
+
+uint16_t ModbusReadPlanner::toPollJobs(ModbusPollJob *jobs, uint16_t maxJobs, uint32_t periodUs, uint8_t priority){
+  if(jobs == 0 || maxJobs < requestCount) return 0;
+  for(uint16_t i=0; i<requestCount; i++){
+    ModbusReadRequest &request = requests[i];
+    jobs[i].set(request.station, request.functionCode, request.startAddress, request.quantity, periodUs, priority);
+    jobs[i].userData = &request;
+  }
+  return requestCount;
+}
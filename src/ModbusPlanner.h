@@ -0,0 +1,82 @@
+#pragma once
+#include "Modbus.h"
+
+/*******************************************读请求合并*******************************************/
+//一个要读取的点(一段地址), 由用户提供的数组保存, 回复拆分后写入words或bits
+class ModbusReadItem{
+public:
+  uint8_t station;
+  uint8_t functionCode;  //0x01~0x04
+  uint16_t address;
+  uint16_t quantity;
+  uint16_t *words;       //0x03/0x04, quantity个寄存器
+  uint8_t *bits;         //0x01/0x02, quantity个0/1
+  void *userData;
+  uint8_t failType;      //最近一次的结果, 同ModbusRS485::failType
+  uint8_t exceptionCode; //从站回复异常时的异常码
+  uint32_t updates;
+
+  inline void setWords(uint8_t argStation, uint8_t argFunctionCode, uint16_t argAddress, uint16_t argQuantity, uint16_t *data){
+    set(argStation, argFunctionCode, argAddress, argQuantity);
+    words = data;
+  }
+  inline void setBits(uint8_t argStation, uint8_t argFunctionCode, uint16_t argAddress, uint16_t argQuantity, uint8_t *data){
+    set(argStation, argFunctionCode, argAddress, argQuantity);
+    bits = data;
+  }
+  inline bool isBits(){ return functionCode == 0x01 || functionCode == 0x02; }
+private:
+  inline void set(uint8_t argStation, uint8_t argFunctionCode, uint16_t argAddress, uint16_t argQuantity){
+    station = argStation;
+    functionCode = argFunctionCode;
+    address = argAddress;
+    quantity = argQuantity;
+    words = 0;
+    bits = 0;
+    userData = 0;
+    failType = ModbusRS485::RcvNoFail;
+    exceptionCode = 0;
+    updates = 0;
+  }
+};
+
+//合并后的一个请求, 覆盖order[firstItem, firstItem+itemCount)中的点
+class ModbusReadRequest{
+public:
+  uint8_t station;
+  uint8_t functionCode;
+  uint16_t startAddress;
+  uint16_t quantity;
+  uint16_t firstItem;
+  uint16_t itemCount;
+};
+
+//把同一站号、同一功能码的读点合并成尽量少的请求, 回复再拆回各个点
+class ModbusReadPlanner{
+public:
+  static const uint16_t MaxReadRegisters = 125;
+  static const uint16_t MaxReadBits = 2000;
+
+  uint16_t maxGap;  //两段之间最多读穿多少个不需要的地址, 默认0: 只合并相邻或重叠的点
+
+  ModbusReadPlanner();
+  //order为itemCount个元素的排序缓冲区, 返回请求数, 点不合法或请求数组不够时返回0
+  uint16_t plan(ModbusReadItem *items, uint16_t itemCount, uint16_t *order, ModbusReadRequest *requests, uint16_t maxRequests);
+  void buildRequest(ModbusReadRequest &request, ModbusFrame &frame);
+  bool applyResponse(ModbusReadRequest &request, ModbusFrame &frame, uint8_t failType);  //成功返回true
+  uint16_t toPollJobs(ModbusPollJob *jobs, uint16_t maxJobs, uint32_t periodUs, uint8_t priority = 0);  //job.userData指向对应请求
+
+  inline uint16_t getRequestCount(){ return requestCount; }
+  inline ModbusReadRequest *getRequest(uint16_t index){ return &requests[index]; }
+  inline ModbusReadItem *getItem(ModbusReadRequest &request, uint16_t i){ return &items[order[request.firstItem + i]]; }
+private:
+  ModbusReadItem *items;
+  uint16_t *order;
+  ModbusReadRequest *requests;
+  uint16_t requestCount;
+
+  bool isBefore(ModbusReadItem &a, ModbusReadItem &b);
+  static inline uint16_t getLimit(uint8_t functionCode){
+    return (functionCode == 0x01 || functionCode == 0x02) ? MaxReadBits : MaxReadRegisters;
+  }
+};
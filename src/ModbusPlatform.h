@@ -0,0 +1,99 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "ModbusCRC.h"
+
+//是否在Arduino环境: 找得到Arduino.h时使用Arduino和CRC16库, 否则(例如Linux网关)使用下面的最小替代
+#ifndef MODBUS_USE_ARDUINO
+  #if defined(ARDUINO)
+    #define MODBUS_USE_ARDUINO 1
+  #elif defined(__has_include)
+    #if __has_include("Arduino.h")
+      #define MODBUS_USE_ARDUINO 1
+    #else
+      #define MODBUS_USE_ARDUINO 0
+    #endif
+  #else
+    #define MODBUS_USE_ARDUINO 1
+  #endif
+#endif
+
+#if MODBUS_USE_ARDUINO
+#include "Arduino.h"
+#include "CRC16.h"
+#else
+#include <stdio.h>
+#include <time.h>
+
+#ifndef UNUSED
+#define UNUSED(x) (void)(x)
+#endif
+
+/*******************************************Arduino替代*******************************************/
+//只提供库内用到的部分: 调试输出用的Print/Stream、微秒/毫秒时钟、CRC16对象
+class Print{
+public:
+  virtual ~Print(){}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *data, size_t length){
+    size_t n = 0;
+    while(n < length && write(data[n])) n ++;
+    return n;
+  }
+  inline size_t print(const char *s){ return write((const uint8_t*)s, strlen(s)); }
+  inline size_t print(int v){ return printFormat("%d", v); }
+  inline size_t print(unsigned int v){ return printFormat("%u", v); }
+  inline size_t print(long v){ return printFormat("%ld", v); }
+  inline size_t print(unsigned long v){ return printFormat("%lu", v); }
+  inline size_t println(){ return write((const uint8_t*)"\r\n", 2); }
+  template<typename T>
+  inline size_t println(T v){ size_t n = print(v); return n + println(); }
+private:
+  template<typename T>
+  inline size_t printFormat(const char *format, T v){
+    char text[24];
+    int n = snprintf(text, sizeof(text), format, v);
+    return n > 0 ? write((const uint8_t*)text, (size_t)n) : 0;
+  }
+};
+
+class Stream : public Print{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  size_t readBytes(uint8_t *data, size_t length){
+    size_t n = 0;
+    while(n < length && available() > 0) data[n++] = (uint8_t)read();
+    return n;
+  }
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+//单调时钟, 和Arduino一样允许回绕
+inline uint32_t micros(){
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000);
+}
+inline uint32_t millis(){
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000);
+}
+#endif
+
+//与CRC16库接口相同, 只支持CRC16/MODBUS, 由内置引擎计算
+#define CRC16MODBUS 1
+class CRC16{
+public:
+  explicit CRC16(int type){ UNUSED(type); clear(); }
+  inline void clear(){ value = ModbusCRC::Init; }
+  inline void update(const uint8_t *data, uint16_t length){ value = ModbusCRC::update(value, data, length); }
+  inline uint16_t get(){ return value; }
+private:
+  uint16_t value;
+};
+#endif
@@ -1,5 +1,5 @@
 #pragma once
-#include "Arduino.h"
+#include "ModbusPlatform.h"
 #include "ModbusPack.h"
 #include <vector>
 #include <stdexcept>
@@ -391,14 +391,14 @@ uint8_t ModbusRegisterVariant::process(ModbusFrame &frameRequest, ModbusFrame &f
     if(!frameResponse.createResponse(frameRequest.pack->getFunctionCode())) return 0;
     switch(frameRequest.pack->getFunctionCode()){
     case MBPReadCoilRegisterRequest::FunctionCode: {
-        MBPReadCoilRegisterRequest *pIn = (MBPReadCoilRegisterRequest *)(frameRequest.pack);
+        MBVReadCoilRegisterRequest pIn = frameRequest.view<MBVReadCoilRegisterRequest>();
         MBPReadCoilRegisterResponse *pOut = (MBPReadCoilRegisterResponse *)(frameResponse.pack);
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读线圈");
         #endif
-        pOut->initValues(pIn->getQuantity());
-        uint16_t startAddress = pIn->getStartAddress();
-        for(uint16_t i=0; i<pIn->getQuantity(); i++){
+        pOut->initValues(pIn.getQuantity());
+        uint16_t startAddress = pIn.getStartAddress();
+        for(uint16_t i=0; i<pIn.getQuantity(); i++){
             uint8_t state = false;
             result = getCoil(startAddress+i,state);
             if(result != 0) break;
@@ -407,14 +407,14 @@ uint8_t ModbusRegisterVariant::process(ModbusFrame &frameRequest, ModbusFrame &f
         break;
     }
     case MBPReadDiscreteInputRegisterRequest::FunctionCode: {
-        MBPReadDiscreteInputRegisterRequest *pIn = (MBPReadDiscreteInputRegisterRequest *)(frameRequest.pack);
+        MBVReadDiscreteInputRegisterRequest pIn = frameRequest.view<MBVReadDiscreteInputRegisterRequest>();
         MBPReadDiscreteInputRegisterResponse *pOut = (MBPReadDiscreteInputRegisterResponse *)(frameResponse.pack);
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读离散输入");
         #endif
-        pOut->initValues(pIn->getQuantity());
-        uint16_t startAddress = pIn->getStartAddress();
-        for(uint16_t i=0; i<pIn->getQuantity(); i++){
+        pOut->initValues(pIn.getQuantity());
+        uint16_t startAddress = pIn.getStartAddress();
+        for(uint16_t i=0; i<pIn.getQuantity(); i++){
             uint8_t state = false;
             result = getDiscreteInput(startAddress+i,state);
             if(result != 0) break;
@@ -423,123 +423,189 @@ uint8_t ModbusRegisterVariant::process(ModbusFrame &frameRequest, ModbusFrame &f
         break;
     }
     case MBPReadHoldingRegisterRequest::FunctionCode: {
-        MBPReadHoldingRegisterRequest *pIn = (MBPReadHoldingRegisterRequest *)(frameRequest.pack);
+        MBVReadHoldingRegisterRequest pIn = frameRequest.view<MBVReadHoldingRegisterRequest>();
         MBPReadHoldingRegisterResponse *pOut = (MBPReadHoldingRegisterResponse *)(frameResponse.pack);
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读保持寄存器");
         #endif
-        pOut->initValues(pIn->getQuantity());
-        uint16_t startAddress = pIn->getStartAddress();
-        for(uint16_t i=0; i<pIn->getQuantity(); i++){
+        uint16_t quantity = pIn.getQuantity();
+        if(quantity > MBPReadHoldingRegisterRequest::MaxQuantity){
+            result = MBPDiagnose::DiagnoseCode_InvalidDataValue;
+            break;
+        }
+        pOut->initValues(quantity);
+        uint16_t startAddress = pIn.getStartAddress();
+        uint16_t words[MBPReadHoldingRegisterRequest::MaxQuantity];
+        for(uint16_t i=0; i<quantity; i++){
             uint16_t state = false;
             result = getHold(startAddress+i,state);
-            pOut->setValue(i,result==0?state:0);
+            words[i] = result==0?state:0;
         }
+        pOut->setValues(words, quantity);  //整块转换为大端
         break;
     }
     case MBPReadInputRegisterRequest::FunctionCode: {
-        MBPReadInputRegisterRequest *pIn = (MBPReadInputRegisterRequest *)(frameRequest.pack);
+        MBVReadInputRegisterRequest pIn = frameRequest.view<MBVReadInputRegisterRequest>();
         MBPReadInputRegisterResponse *pOut = (MBPReadInputRegisterResponse *)(frameResponse.pack);
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读输入寄存器");
         #endif
-        pOut->initValues(pIn->getQuantity());
-        uint16_t startAddress = pIn->getStartAddress();
-        for(uint16_t i=0; i<pIn->getQuantity(); i++){
+        uint16_t quantity = pIn.getQuantity();
+        if(quantity > MBPReadInputRegisterRequest::MaxQuantity){
+            result = MBPDiagnose::DiagnoseCode_InvalidDataValue;
+            break;
+        }
+        pOut->initValues(quantity);
+        uint16_t startAddress = pIn.getStartAddress();
+        uint16_t words[MBPReadInputRegisterRequest::MaxQuantity];
+        for(uint16_t i=0; i<quantity; i++){
             uint16_t state = false;
             result = getInput(startAddress+i,state);
             if(result != 0) break;
-            pOut->setValue(i,state);
+            words[i] = state;
         }
+        if(result == 0) pOut->setValues(words, quantity);  //整块转换为大端
         break;
     }
     case MBPWriteCoilRegisterRequest::FunctionCode: {
-        MBPWriteCoilRegisterRequest *pIn = (MBPWriteCoilRegisterRequest *)(frameRequest.pack);
-        MBPWriteCoilRegisterResponse *pOut = (MBPWriteCoilRegisterResponse *)(frameResponse.pack);
-        uint16_t startAddress = pIn->getStartAddress();
+        MBVWriteCoilRegisterRequest pIn = frameRequest.view<MBVWriteCoilRegisterRequest>();
+        MBVWriteCoilRegisterResponse pOut = frameResponse.view<MBVWriteCoilRegisterResponse>();  //定长回复, createResponse已确定包尾
+        uint16_t startAddress = pIn.getStartAddress();
         #ifdef DEBUG_MODBUS_ON
         Serial.println("写单线圈开始");
         Serial.print(startAddress);
         Serial.print(":");
-        Serial.println(pIn->getValue());
-        Serial.println(pIn->value->get());
+        Serial.println(pIn.getValue());
+        Serial.println(pIn.getRawValue());
         Serial.println("写单线圈结束");
         #endif
-        result = setCoil(startAddress,pIn->getValue());
+        result = setCoil(startAddress,pIn.getValue());
         if(result != 0) break;
-        pOut->setValue(pIn->getValue());
-        pOut->setStartAddress(pIn->getStartAddress());
+        pOut.setValue(pIn.getValue());
+        pOut.setStartAddress(pIn.getStartAddress());
         break;
     }
     case MBPWriteHoldingRegisterRequest::FunctionCode: {
-        MBPWriteHoldingRegisterRequest *pIn = (MBPWriteHoldingRegisterRequest *)(frameRequest.pack);
-        MBPWriteHoldingRegisterResponse *pOut = (MBPWriteHoldingRegisterResponse *)(frameResponse.pack);
-        uint16_t startAddress = pIn->getStartAddress();
+        MBVWriteHoldingRegisterRequest pIn = frameRequest.view<MBVWriteHoldingRegisterRequest>();
+        MBVWriteHoldingRegisterResponse pOut = frameResponse.view<MBVWriteHoldingRegisterResponse>();  //定长回复, createResponse已确定包尾
+        uint16_t startAddress = pIn.getStartAddress();
         #ifdef DEBUG_MODBUS_ON
         Serial.println("写单保持寄存器开始");
         Serial.print(startAddress);
         Serial.print(":");
-        Serial.println(pIn->getValue());
+        Serial.println(pIn.getValue());
         Serial.println("写单保持寄存器结束");
         #endif
-        result = setHold(startAddress,pIn->getValue());
+        result = setHold(startAddress,pIn.getValue());
         if(result != 0) break;
-        pOut->setValue(pIn->getValue());
-        pOut->setStartAddress(pIn->getStartAddress());
+        pOut.setValue(pIn.getValue());
+        pOut.setStartAddress(pIn.getStartAddress());
         break;
     }
     case MBPWriteMultipleCoilRegistersRequest::FunctionCode: {
-        MBPWriteMultipleCoilRegistersRequest *pIn = (MBPWriteMultipleCoilRegistersRequest *)(frameRequest.pack);
-        MBPWriteMultipleCoilRegistersResponse *pOut = (MBPWriteMultipleCoilRegistersResponse *)(frameResponse.pack);
-        uint16_t startAddress = pIn->getStartAddress();
-        if((pIn->getQuantity()+7)/8 != pIn->getBytes()){
+        MBVWriteMultipleCoilRegistersRequest pIn = frameRequest.view<MBVWriteMultipleCoilRegistersRequest>();
+        MBVWriteMultipleCoilRegistersResponse pOut = frameResponse.view<MBVWriteMultipleCoilRegistersResponse>();  //定长回复, createResponse已确定包尾
+        uint16_t startAddress = pIn.getStartAddress();
+        if((pIn.getQuantity()+7)/8 != pIn.getBytes()){
             result = MBPDiagnose::DiagnoseCode_InvalidDataValue;
             break;
         }
         #ifdef DEBUG_MODBUS_ON
         Serial.println("写多线圈开始");
         #endif
-        for(uint16_t i=0; i<pIn->getQuantity(); i++){
-            result = setCoil(startAddress+i,pIn->getValue(i));
+        for(uint16_t i=0; i<pIn.getQuantity(); i++){
+            result = setCoil(startAddress+i,pIn.getValue(i));
             #ifdef DEBUG_MODBUS_ON
             Serial.print(startAddress+i);
             Serial.print(":");
-            Serial.println(pIn->getValue(i));
+            Serial.println(pIn.getValue(i));
             #endif
             if(result != 0) break;
         }
         #ifdef DEBUG_MODBUS_ON
         Serial.println("写多线圈结束");
         #endif
-        pOut->setStartAddress(pIn->getStartAddress());
-        pOut->setQuantity(pIn->getQuantity());
+        pOut.setStartAddress(pIn.getStartAddress());
+        pOut.setQuantity(pIn.getQuantity());
         break;
     }
     case MBPWriteMultipleHoldingRegistersRequest::FunctionCode: {
-        MBPWriteMultipleHoldingRegistersRequest *pIn = (MBPWriteMultipleHoldingRegistersRequest *)(frameRequest.pack);
-        MBPWriteMultipleHoldingRegistersResponse *pOut = (MBPWriteMultipleHoldingRegistersResponse *)(frameResponse.pack);
-        uint16_t startAddress = pIn->getStartAddress();
-        if(pIn->getQuantity()*2 != pIn->getBytes()){
+        MBVWriteMultipleHoldingRegistersRequest pIn = frameRequest.view<MBVWriteMultipleHoldingRegistersRequest>();
+        MBVWriteMultipleHoldingRegistersResponse pOut = frameResponse.view<MBVWriteMultipleHoldingRegistersResponse>();  //定长回复, createResponse已确定包尾
+        uint16_t startAddress = pIn.getStartAddress();
+        if(pIn.getQuantity()*2 != pIn.getBytes()){
             result = MBPDiagnose::DiagnoseCode_InvalidDataValue;
             break;
         }
         #ifdef DEBUG_MODBUS_ON
         Serial.println("写多保持寄存器开始");
         #endif
-        for(uint16_t i=0; i<pIn->getQuantity(); i++){
-            result = setHold(startAddress+i,pIn->getValue(i));
+        uint16_t words[MBPReadHoldingRegisterRequest::MaxQuantity+2];  //字节数只有1字节, 最多127个寄存器
+        pIn.getValues(words, pIn.getQuantity());
+        for(uint16_t i=0; i<pIn.getQuantity(); i++){
+            result = setHold(startAddress+i,words[i]);
             #ifdef DEBUG_MODBUS_ON
             Serial.print(startAddress+i);
             Serial.print(":");
-            Serial.println(pIn->getValue(i));
+            Serial.println(words[i]);
             #endif
             if(result != 0) break;
         }
         #ifdef DEBUG_MODBUS_ON
         Serial.println("写多保持寄存器结束");
         #endif
-        pOut->setStartAddress(startAddress);
-        pOut->setQuantity(pIn->getQuantity());
+        pOut.setStartAddress(startAddress);
+        pOut.setQuantity(pIn.getQuantity());
+        break;
+    }
+    case MBPMaskWriteRegisterRequest::FunctionCode: {
+        MBVMaskWriteRegisterRequest pIn = frameRequest.view<MBVMaskWriteRegisterRequest>();
+        MBVMaskWriteRegisterResponse pOut = frameResponse.view<MBVMaskWriteRegisterResponse>();  //定长回复, createResponse已确定包尾
+        uint16_t startAddress = pIn.getStartAddress();
+        #ifdef DEBUG_MODBUS_ON
+        Serial.println("屏蔽写保持寄存器");
+        #endif
+        //读-改-写在一次process中完成, 中间不会插入其他请求; 写入仍经过onHoldPreSet/onHoldSet
+        uint16_t current = 0;
+        result = getHold(startAddress,current);
+        if(result != 0) break;
+        result = setHold(startAddress,pIn.apply(current));
+        if(result != 0) break;
+        pOut.setStartAddress(startAddress);
+        pOut.setAndMask(pIn.getAndMask());
+        pOut.setOrMask(pIn.getOrMask());
+        break;
+    }
+    case MBPReadWriteMultipleRegistersRequest::FunctionCode: {
+        MBVReadWriteMultipleRegistersRequest pIn = frameRequest.view<MBVReadWriteMultipleRegistersRequest>();
+        MBPReadWriteMultipleRegistersResponse *pOut = (MBPReadWriteMultipleRegistersResponse *)(frameResponse.pack);
+        #ifdef DEBUG_MODBUS_ON
+        Serial.println("读写多保持寄存器");
+        #endif
+        uint16_t readQuantity = pIn.getReadQuantity();
+        uint16_t writeQuantity = pIn.getWriteQuantity();
+        if(readQuantity == 0 || readQuantity > MBPReadWriteMultipleRegistersRequest::MaxReadQuantity
+            || writeQuantity == 0 || writeQuantity > MBPReadWriteMultipleRegistersRequest::MaxWriteQuantity
+            || writeQuantity*2 != pIn.getBytes()){
+            result = MBPDiagnose::DiagnoseCode_InvalidDataValue;
+            break;
+        }
+        uint16_t words[MBPReadWriteMultipleRegistersRequest::MaxReadQuantity];  //写入和读取共用
+        //协议规定先写后读
+        uint16_t startAddress = pIn.getWriteStartAddress();
+        pIn.getValues(words, writeQuantity);
+        for(uint16_t i=0; i<writeQuantity; i++){
+            result = setHold(startAddress+i,words[i]);
+            if(result != 0) break;
+        }
+        if(result != 0) break;
+        pOut->initValues(readQuantity);
+        startAddress = pIn.getReadStartAddress();
+        for(uint16_t i=0; i<readQuantity; i++){
+            uint16_t state = 0;
+            words[i] = getHold(startAddress+i,state)==0?state:0;
+        }
+        pOut->setValues(words, readQuantity);  //整块转换为大端
         break;
     }
     default:
@@ -563,53 +629,81 @@ uint8_t ModbusRegisterVariant::processResponse(ModbusFrame &frameResponse, Modbu
     if(frameResponse.pack->getFunctionCode() != frameRequest.pack->getFunctionCode()) return 253;
     switch(frameResponse.pack->getFunctionCode()){
     case MBPReadCoilRegisterResponse::FunctionCode: {
-        MBPReadCoilRegisterRequest *fReq = (MBPReadCoilRegisterRequest *)(frameRequest.pack);
-        MBPReadCoilRegisterResponse *fResp = (MBPReadCoilRegisterResponse *)(frameResponse.pack);
+        MBVReadCoilRegisterRequest fReq = frameRequest.view<MBVReadCoilRegisterRequest>();
+        MBVReadCoilRegisterResponse fResp = frameResponse.view<MBVReadCoilRegisterResponse>();
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读线圈");
         #endif
-        uint16_t startAddress = fReq->getStartAddress();
-        for(uint16_t i=0; i<fReq->getQuantity(); i++){
-            result = setCoil(startAddress+i,fResp->getValue(i));
+        uint16_t startAddress = fReq.getStartAddress();
+        for(uint16_t i=0; i<fReq.getQuantity(); i++){
+            result = setCoil(startAddress+i,fResp.getValue(i));
             if(result != 0) break;
         }
         break;
     }
     case MBPReadDiscreteInputRegisterResponse::FunctionCode: {
-        MBPReadDiscreteInputRegisterRequest *fReq = (MBPReadDiscreteInputRegisterRequest *)(frameRequest.pack);
-        MBPReadDiscreteInputRegisterResponse *fResp = (MBPReadDiscreteInputRegisterResponse *)(frameResponse.pack);
+        MBVReadDiscreteInputRegisterRequest fReq = frameRequest.view<MBVReadDiscreteInputRegisterRequest>();
+        MBVReadDiscreteInputRegisterResponse fResp = frameResponse.view<MBVReadDiscreteInputRegisterResponse>();
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读离散输入");
         #endif
-        uint16_t startAddress = fReq->getStartAddress();
-        for(uint16_t i=0; i<fReq->getQuantity(); i++){
-            result = setDiscreteInput(startAddress+i,fResp->getValue(i));
+        uint16_t startAddress = fReq.getStartAddress();
+        for(uint16_t i=0; i<fReq.getQuantity(); i++){
+            result = setDiscreteInput(startAddress+i,fResp.getValue(i));
             if(result != 0) break;
         }
         break;
     }
     case MBPReadHoldingRegisterResponse::FunctionCode: {
-        MBPReadHoldingRegisterRequest *fReq = (MBPReadHoldingRegisterRequest *)(frameRequest.pack);
-        MBPReadHoldingRegisterResponse *fResp = (MBPReadHoldingRegisterResponse *)(frameResponse.pack);
+        MBVReadHoldingRegisterRequest fReq = frameRequest.view<MBVReadHoldingRegisterRequest>();
+        MBVReadHoldingRegisterResponse fResp = frameResponse.view<MBVReadHoldingRegisterResponse>();
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读保持寄存器");
         #endif
-        uint16_t startAddress = fReq->getStartAddress();
-        for(uint16_t i=0; i<fReq->getQuantity(); i++){
-            result = setHold(startAddress+i,fResp->getValue(i));
+        uint16_t startAddress = fReq.getStartAddress();
+        uint16_t quantity = fReq.getQuantity();
+        if(quantity > MBPReadHoldingRegisterRequest::MaxQuantity) quantity = MBPReadHoldingRegisterRequest::MaxQuantity;
+        uint16_t words[MBPReadHoldingRegisterRequest::MaxQuantity];
+        uint16_t received = fResp.getValues(words, quantity);  //整块从大端转换
+        memset(words+received, 0, (quantity-received)*sizeof(uint16_t)); //回复不足的部分按0处理
+        for(uint16_t i=0; i<quantity; i++){
+            result = setHold(startAddress+i,words[i]);
             if(result != 0) break;
         }
         break;
     }
     case MBPReadInputRegisterResponse::FunctionCode: {
-        MBPReadInputRegisterRequest *fReq = (MBPReadInputRegisterRequest *)(frameRequest.pack);
-        MBPReadInputRegisterResponse *fResp = (MBPReadInputRegisterResponse *)(frameResponse.pack);
+        MBVReadInputRegisterRequest fReq = frameRequest.view<MBVReadInputRegisterRequest>();
+        MBVReadInputRegisterResponse fResp = frameResponse.view<MBVReadInputRegisterResponse>();
         #ifdef DEBUG_MODBUS_ON
         Serial.println("读输入寄存器");
         #endif
-        uint16_t startAddress = fReq->getStartAddress();
-        for(uint16_t i=0; i<fReq->getQuantity(); i++){
-            result = setInput(startAddress+i,fResp->getValue(i));
+        uint16_t startAddress = fReq.getStartAddress();
+        uint16_t quantity = fReq.getQuantity();
+        if(quantity > MBPReadInputRegisterRequest::MaxQuantity) quantity = MBPReadInputRegisterRequest::MaxQuantity;
+        uint16_t words[MBPReadInputRegisterRequest::MaxQuantity];
+        uint16_t received = fResp.getValues(words, quantity);  //整块从大端转换
+        memset(words+received, 0, (quantity-received)*sizeof(uint16_t)); //回复不足的部分按0处理
+        for(uint16_t i=0; i<quantity; i++){
+            result = setInput(startAddress+i,words[i]);
+            if(result != 0) break;
+        }
+        break;
+    }
+    case MBPReadWriteMultipleRegistersResponse::FunctionCode: {
+        MBVReadWriteMultipleRegistersRequest fReq = frameRequest.view<MBVReadWriteMultipleRegistersRequest>();
+        MBVReadWriteMultipleRegistersResponse fResp = frameResponse.view<MBVReadWriteMultipleRegistersResponse>();
+        #ifdef DEBUG_MODBUS_ON
+        Serial.println("读写多保持寄存器");
+        #endif
+        uint16_t startAddress = fReq.getReadStartAddress();
+        uint16_t quantity = fReq.getReadQuantity();
+        if(quantity > MBPReadWriteMultipleRegistersRequest::MaxReadQuantity) quantity = MBPReadWriteMultipleRegistersRequest::MaxReadQuantity;
+        uint16_t words[MBPReadWriteMultipleRegistersRequest::MaxReadQuantity];
+        uint16_t received = fResp.getValues(words, quantity);  //整块从大端转换
+        memset(words+received, 0, (quantity-received)*sizeof(uint16_t)); //回复不足的部分按0处理
+        for(uint16_t i=0; i<quantity; i++){
+            result = setHold(startAddress+i,words[i]);
             if(result != 0) break;
         }
         break;
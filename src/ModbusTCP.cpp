@@ -0,0 +1,1032 @@
+#include "ModbusTCP.h"
+/* TCP Modbus 协议 */
+#if defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+
+static const uint16_t ModbusTCPNoConnection = 0xFFFF;
+
+ModbusTCPServer::ModbusTCPServer(){
+  onReceived = 0;
+  userData = 0;
+  currentConnection = 0;
+  failType = RcvNoFail;
+  listenFd = -1;
+  epollFd = -1;
+  connections = 0;
+  connectionPoolSize = 0;
+  connectionCount = 0;
+  freeHead = ModbusTCPNoConnection;
+  clearStatics();
+}
+
+ModbusTCPServer::~ModbusTCPServer(){
+  end();
+}
+
+void ModbusTCPServer::clearStatics(){
+  rxPacks = 0;
+  rxFailPacks = 0;
+  txPacks = 0;
+  acceptedConnections = 0;
+  rejectedConnections = 0;
+}
+
+bool ModbusTCPServer::begin(ModbusTCPConnection *connectionPool, uint16_t poolSize, uint16_t port, const char *bindAddress){
+  end();
+  if(connectionPool == 0 || poolSize == 0 || poolSize == ModbusTCPNoConnection) return false;
+  connections = connectionPool;
+  connectionPoolSize = poolSize;
+  connectionCount = 0;
+  for(uint16_t i=0; i<poolSize; i++){ //建立空闲链表
+    connections[i].fd = -1;
+    connections[i].generation = 0;
+    connections[i].nextFree = (i+1 < poolSize) ? (uint16_t)(i+1) : ModbusTCPNoConnection;
+  }
+  freeHead = 0;
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if(bindAddress && inet_pton(AF_INET, bindAddress, &addr.sin_addr) != 1) return false;
+
+  listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(listenFd < 0) return false;
+  int enable = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+  if(bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, SOMAXCONN) != 0){
+    end();
+    return false;
+  }
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if(epollFd < 0){
+    end();
+    return false;
+  }
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;  //监听套接字
+  if(epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev) != 0){
+    end();
+    return false;
+  }
+  return true;
+}
+
+void ModbusTCPServer::end(){
+  if(connections){
+    for(uint16_t i=0; i<connectionPoolSize; i++){
+      if(connections[i].isOpen()) closeConnection(&connections[i]);
+    }
+  }
+  if(listenFd >= 0) close(listenFd);
+  if(epollFd >= 0) close(epollFd);
+  listenFd = -1;
+  epollFd = -1;
+  connections = 0;
+  connectionPoolSize = 0;
+  connectionCount = 0;
+  freeHead = ModbusTCPNoConnection;
+  currentConnection = 0;
+}
+
+uint16_t ModbusTCPServer::update(int timeoutMs){
+  if(epollFd < 0) return 0;
+  epoll_event events[64];
+  int n = epoll_wait(epollFd, events, 64, timeoutMs);
+  if(n <= 0) return 0;
+  for(int i=0; i<n; i++){
+    ModbusTCPConnection *connection = (ModbusTCPConnection*)events[i].data.ptr;
+    if(connection == 0){
+      acceptConnections();
+      continue;
+    }
+    if(!connection->isOpen()) continue;  //本轮中已被关闭
+    if(events[i].events & (EPOLLERR | EPOLLHUP)){
+      closeConnection(connection);
+      continue;
+    }
+    if(events[i].events & EPOLLOUT){
+      if(!onWritable(connection)) continue;
+    }
+    if(events[i].events & EPOLLIN) onReadable(connection);
+  }
+  return (uint16_t)n;
+}
+
+void ModbusTCPServer::acceptConnections(){
+  while(true){
+    int fd = accept4(listenFd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0) return; //EAGAIN: 已全部接受
+    if(freeHead == ModbusTCPNoConnection){  //连接池已满
+      close(fd);
+      rejectedConnections ++;
+      continue;
+    }
+    int enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)); //回复立即发出, 不等待Nagle合并
+    ModbusTCPConnection *connection = &connections[freeHead];
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = connection;
+    if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) != 0){
+      close(fd);
+      rejectedConnections ++;
+      continue;
+    }
+    freeHead = connection->nextFree;
+    connection->fd = fd;
+    connection->rxLength = 0;
+    connection->txLength = 0;
+    connection->txOffset = 0;
+    connection->transactionID = 0;
+    connection->generation ++;
+    connectionCount ++;
+    acceptedConnections ++;
+  }
+}
+
+void ModbusTCPServer::closeConnection(ModbusTCPConnection *connection){
+  if(!connection->isOpen()) return;
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, 0);
+  close(connection->fd);
+  connection->fd = -1;
+  connection->rxLength = 0;
+  connection->txLength = 0;
+  connection->nextFree = freeHead;
+  freeHead = (uint16_t)(connection - connections);
+  connectionCount --;
+}
+
+void ModbusTCPServer::setWaitWritable(ModbusTCPConnection *connection, bool waitWritable){
+  epoll_event ev;
+  ev.events = waitWritable ? EPOLLOUT : EPOLLIN;  //发送积压时暂停读取, 对端自然被TCP窗口限速
+  ev.data.ptr = connection;
+  epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &ev);
+}
+
+void ModbusTCPServer::onReadable(ModbusTCPConnection *connection){
+  ssize_t n = read(connection->fd, connection->rxBuffer + connection->rxLength, ModbusTCP::MaxADUSize - connection->rxLength);
+  if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+    closeConnection(connection);
+    return;
+  }
+  if(n < 0) return;
+  connection->rxLength += (uint16_t)n;
+  processConnection(connection);
+}
+
+bool ModbusTCPServer::onWritable(ModbusTCPConnection *connection){
+  if(connection->txLength){
+    ssize_t n = send(connection->fd, connection->txBuffer + connection->txOffset, connection->txLength, MSG_NOSIGNAL);
+    if(n < 0){
+      if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return true;
+      closeConnection(connection);
+      return false;
+    }
+    connection->txOffset += (uint16_t)n;
+    connection->txLength -= (uint16_t)n;
+    if(connection->txLength) return true;
+  }
+  connection->txOffset = 0;
+  setWaitWritable(connection, false);
+  processConnection(connection);  //继续处理积压期间已收到的请求
+  return connection->isOpen();
+}
+
+//一个TCP分段里可能有多个请求, 也可能只有半个, 逐个取出完整的ADU处理
+void ModbusTCPServer::processConnection(ModbusTCPConnection *connection){
+  while(connection->isOpen() && connection->txLength == 0 && connection->rxLength >= ModbusTCP::MBAPHeaderSize){
+    uint8_t *adu = connection->rxBuffer;
+    uint16_t length = ModbusTCP::getU16(adu+4);  //单元号+PDU
+    if(ModbusTCP::getU16(adu+2) != 0 || length < 2 || length > ModbusTCP::MaxPDUSize+1){
+      rxFailPacks ++;
+      closeConnection(connection); //协议号错误或长度非法, 无法再找到下一帧的边界
+      return;
+    }
+    uint16_t aduLength = (uint16_t)(length + ModbusTCP::MBAPHeaderSize - 1);
+    if(connection->rxLength < aduLength) return;  //等待剩余数据
+    connection->transactionID = ModbusTCP::getU16(adu);
+    memcpy(rxFrame.buffer, adu+ModbusTCP::MBAPHeaderSize-1, length);
+    rxFrame.validDataLength = length;
+    rxPacks ++;
+    currentConnection = connection;
+    if(rxFrame.castRequest()){
+      failType = RcvNoFail;
+      if(onReceived) onReceived(this);
+    }else{
+      failType = RcvUnsupportedFunctionCode;
+      rxFailPacks ++;
+      replyDiagnose(connection, MBPDiagnose::DiagnoseCode_InvalidFunctionCode);
+    }
+    currentConnection = 0;
+    if(!connection->isOpen()) return;  //回调中关闭了连接
+    connection->rxLength -= aduLength;
+    if(connection->rxLength) memmove(connection->rxBuffer, connection->rxBuffer+aduLength, connection->rxLength);
+  }
+}
+
+void ModbusTCPServer::replyDiagnose(ModbusTCPConnection *connection, uint8_t diagnoseCode){
+  txFrame.createDiagnose(rxFrame.getFunctionCode());
+  txFrame.view<MBVDiagnose>().setDiagnoseCode(diagnoseCode);  //异常码原样写入
+  *(txFrame.station) = rxFrame.getStation();
+  sendADU(connection, connection->transactionID, txFrame.buffer, txFrame.pack->getSize());
+}
+
+bool ModbusTCPServer::transmit(){
+  if(currentConnection == 0 || txFrame.pack == 0) return false;
+  *(txFrame.station) = rxFrame.getStation(); //单元号原样返回
+  return sendADU(currentConnection, currentConnection->transactionID, txFrame.buffer, txFrame.pack->getSize());
+}
+
+bool ModbusTCPServer::transmit(ModbusTCPConnection *connection, uint16_t transactionID, uint8_t unitID){
+  if(connection == 0 || !connection->isOpen() || txFrame.pack == 0) return false;
+  *(txFrame.station) = unitID;
+  return sendADU(connection, transactionID, txFrame.buffer, txFrame.pack->getSize());
+}
+
+bool ModbusTCPServer::transmitRaw(ModbusTCPConnection *connection, uint16_t transactionID, uint16_t length){
+  if(connection == 0 || !connection->isOpen() || length < 2 || length > ModbusTCP::MaxPDUSize+1) return false;
+  return sendADU(connection, transactionID, txFrame.buffer, length);
+}
+
+//MBAP头和帧缓冲区一次sendmsg发出, 只有内核发送缓冲区已满时才拷贝剩余部分到连接的发送缓冲
+bool ModbusTCPServer::sendADU(ModbusTCPConnection *connection, uint16_t transactionID, uint8_t *frame, uint16_t length){
+  uint8_t header[ModbusTCP::MBAPHeaderSize-1];
+  ModbusTCP::buildHeader(header, transactionID, length);
+  uint16_t total = (uint16_t)(sizeof(header) + length);
+  ssize_t n = 0;
+  if(connection->txLength == 0){
+    iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = frame;
+    iov[1].iov_len = length;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    n = sendmsg(connection->fd, &msg, MSG_NOSIGNAL);
+    if(n < 0){
+      if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+        closeConnection(connection);
+        return false;
+      }
+      n = 0;
+    }
+    txPacks ++;
+    if(n == total) return true;
+    connection->txOffset = 0;
+  }else{
+    if(connection->txOffset){ //先把未发完的部分移到缓冲区头部
+      memmove(connection->txBuffer, connection->txBuffer+connection->txOffset, connection->txLength);
+      connection->txOffset = 0;
+    }
+    if(connection->txLength + total > ModbusTCP::MaxADUSize) return false;  //上一个回复还没发完
+    txPacks ++;
+  }
+  uint8_t *pTx = connection->txBuffer + connection->txLength;
+  for(uint16_t i=(uint16_t)n; i<total; i++){
+    *pTx++ = i < sizeof(header) ? header[i] : frame[i-sizeof(header)];
+  }
+  connection->txLength = (uint16_t)(connection->txLength + total - n);
+  setWaitWritable(connection, true);
+  return true;
+}
+
+
+/*******************************************Modbus TCP 主站*******************************************/
+ModbusTCPMaster::ModbusTCPMaster(){
+  onReceived = 0;
+  currentTransaction = 0;
+  timeOut = 1000000;
+  failType = RcvNoFail;
+  fd = -1;
+  connecting = false;
+  address = 0;
+  port = ModbusTCP::DefaultPort;
+  window = 0;
+  windowSize = 0;
+  inFlight = 0;
+  freeHead = ModbusTCPNoConnection;
+  generation = 0;
+  txLength = 0;
+  txOffset = 0;
+  rxLength = 0;
+  clearStatics();
+}
+
+ModbusTCPMaster::~ModbusTCPMaster(){
+  end();
+}
+
+void ModbusTCPMaster::clearStatics(){
+  rxPacks = 0;
+  rxFailPacks = 0;
+  txPacks = 0;
+  timedoutPacks = 0;
+}
+
+bool ModbusTCPMaster::begin(ModbusTCPTransaction *argWindow, uint16_t argWindowSize, const char *host, uint16_t argPort, uint32_t timeOutUs){
+  end();
+  if(argWindow == 0 || argWindowSize == 0 || argWindowSize > MaxWindowSize) return false;
+  in_addr addr;
+  if(host == 0 || inet_pton(AF_INET, host, &addr) != 1) return false;
+  address = addr.s_addr;
+  port = argPort;
+  timeOut = timeOutUs;
+  window = argWindow;
+  windowSize = argWindowSize;
+  for(uint16_t i=0; i<windowSize; i++){ //建立空闲链表
+    window[i].requestLength = 0;
+    window[i].nextFree = (i+1 < windowSize) ? (uint16_t)(i+1) : ModbusTCPNoConnection;
+  }
+  freeHead = 0;
+  inFlight = 0;
+  return connect();
+}
+
+void ModbusTCPMaster::end(){
+  closeConnection();
+  window = 0;
+  windowSize = 0;
+  freeHead = ModbusTCPNoConnection;
+}
+
+bool ModbusTCPMaster::connect(){
+  if(fd >= 0) return true;
+  if(window == 0) return false;
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0) return false;
+  int enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)); //批量由发送缓冲完成, 不需要Nagle
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = address;
+  txLength = 0;
+  txOffset = 0;
+  rxLength = 0;
+  if(::connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0){
+    connecting = false;
+    return true;
+  }
+  if(errno != EINPROGRESS){
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  connecting = true;  //在update中等待连接完成
+  return true;
+}
+
+bool ModbusTCPMaster::finishConnect(){
+  pollfd pfd = { fd, POLLOUT, 0 };
+  if(poll(&pfd, 1, 0) <= 0) return false;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0){
+    closeConnection();
+    return false;
+  }
+  connecting = false;
+  return true;
+}
+
+//连接断开, 在途事务全部以RcvConnectionLost结束
+void ModbusTCPMaster::closeConnection(){
+  if(fd >= 0) close(fd);
+  fd = -1;
+  connecting = false;
+  txLength = 0;
+  txOffset = 0;
+  rxLength = 0;
+  for(uint16_t i=0; i<windowSize && inFlight; i++){
+    if(!window[i].isInFlight()) continue;
+    failType = RcvConnectionLost;
+    rxFailPacks ++;
+    rxFrame.validDataLength = 0;
+    complete(&window[i]);
+  }
+}
+
+bool ModbusTCPMaster::availableToTransmit(){
+  return fd >= 0 && freeHead != ModbusTCPNoConnection;
+}
+
+bool ModbusTCPMaster::transmit(uint8_t unitID){
+  if(txFrame.pack == 0) return false;
+  return enqueue(unitID, txFrame.pack->getSize());
+}
+
+bool ModbusTCPMaster::transmitRaw(uint8_t unitID, uint16_t length){
+  if(length < 2 || length > ModbusTCP::MaxPDUSize+1) return false;
+  return enqueue(unitID, length);
+}
+
+//分配事务号并把ADU追加到发送缓冲, 真正的send在flush/update中一次完成
+bool ModbusTCPMaster::enqueue(uint8_t unitID, uint16_t length){
+  if(!availableToTransmit()) return false;
+  uint16_t aduLength = (uint16_t)(length + ModbusTCP::MBAPHeaderSize - 1);
+  if(txOffset + txLength + aduLength > TxBatchSize){
+    if(txOffset){
+      memmove(txBuffer, txBuffer+txOffset, txLength);
+      txOffset = 0;
+    }
+    if(txLength + aduLength > TxBatchSize){
+      flush();
+      if(fd < 0) return false;  //发送出错, 连接已关闭, 在途请求已按RcvConnectionLost结束
+      if(txLength + aduLength > TxBatchSize) return false;  //内核发送缓冲已满
+    }
+  }
+  uint16_t index = freeHead;
+  ModbusTCPTransaction *transaction = &window[index];
+  freeHead = transaction->nextFree;
+  inFlight ++;
+  generation ++;
+  transaction->transactionID = (uint16_t)((generation << 8) | index);  //低8位即槽位, 回复O(1)定位
+  transaction->requestLength = length;
+  transaction->sentTick = micros();
+  *(txFrame.station) = unitID;
+  memcpy(transaction->request, txFrame.buffer, length);
+  uint8_t *pTx = txBuffer + txOffset + txLength;
+  ModbusTCP::buildHeader(pTx, transaction->transactionID, length);
+  memcpy(pTx + ModbusTCP::MBAPHeaderSize-1, txFrame.buffer, length);
+  txLength += aduLength;
+  txPacks ++;
+  return true;
+}
+
+bool ModbusTCPMaster::flush(){
+  if(fd < 0 || connecting || txLength == 0) return txLength == 0;
+  ssize_t n = send(fd, txBuffer + txOffset, txLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if(n < 0){
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+    closeConnection();
+    return false;
+  }
+  txOffset += (uint16_t)n;
+  txLength -= (uint16_t)n;
+  if(txLength == 0) txOffset = 0;
+  return txLength == 0;
+}
+
+void ModbusTCPMaster::update(int timeoutMs){
+  if(fd >= 0 && connecting) finishConnect();
+  if(fd >= 0 && !connecting){
+    flush();
+    if(timeoutMs != 0 && fd >= 0){
+      pollfd pfd = { fd, (short)(POLLIN | (txLength ? POLLOUT : 0)), 0 };
+      poll(&pfd, 1, timeoutMs);
+      flush();
+    }
+    if(fd >= 0) receive();
+  }
+  checkTimeouts();
+}
+
+void ModbusTCPMaster::receive(){
+  while(fd >= 0){
+    ssize_t n = recv(fd, rxBuffer + rxLength, RxBufferSize - rxLength, MSG_DONTWAIT);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+      closeConnection();
+      return;
+    }
+    if(n < 0) return;
+    rxLength += (uint16_t)n;
+    processResponses();
+  }
+}
+
+void ModbusTCPMaster::processResponses(){
+  uint16_t offset = 0;
+  while(fd >= 0 && rxLength - offset >= ModbusTCP::MBAPHeaderSize){
+    uint8_t *adu = rxBuffer + offset;
+    uint16_t length = ModbusTCP::getU16(adu+4);  //单元号+PDU
+    if(ModbusTCP::getU16(adu+2) != 0 || length < 2 || length > ModbusTCP::MaxPDUSize+1){
+      rxFailPacks ++;
+      closeConnection(); //无法再找到下一帧的边界
+      return;
+    }
+    uint16_t aduLength = (uint16_t)(length + ModbusTCP::MBAPHeaderSize - 1);
+    if(rxLength - offset < aduLength) break;  //等待剩余数据
+    offset += aduLength;
+    uint16_t transactionID = ModbusTCP::getU16(adu);
+    uint16_t index = transactionID & 0xFF;
+    if(index >= windowSize || !window[index].isInFlight() || window[index].transactionID != transactionID){
+      rxFailPacks ++;  //已超时或未知的事务, 丢弃
+      continue;
+    }
+    memcpy(rxFrame.buffer, adu+ModbusTCP::MBAPHeaderSize-1, length);
+    rxFrame.validDataLength = length;
+    rxPacks ++;
+    if(rxFrame.castResponse()){
+      failType = RcvNoFail;
+    }else{
+      failType = RcvUnsupportedFunctionCode;
+      rxFailPacks ++;
+    }
+    complete(&window[index]);
+  }
+  if(fd < 0) return;
+  rxLength -= offset;
+  if(rxLength && offset) memmove(rxBuffer, rxBuffer+offset, rxLength);
+}
+
+//超时按槽位扫描, 窗口不大, 一次update扫描一遍即可
+void ModbusTCPMaster::checkTimeouts(){
+  if(inFlight == 0) return;
+  uint32_t now = micros();
+  for(uint16_t i=0; i<windowSize; i++){
+    if(!window[i].isInFlight() || now-window[i].sentTick <= timeOut) continue;
+    failType = RcvWaitTimedout;
+    rxFailPacks ++;
+    timedoutPacks ++;
+    rxFrame.validDataLength = 0;
+    complete(&window[i]);
+  }
+}
+
+//还原请求帧后回调, 回调结束释放槽位
+void ModbusTCPMaster::complete(ModbusTCPTransaction *transaction){
+  memcpy(requestFrame.buffer, transaction->request, transaction->requestLength);
+  requestFrame.validDataLength = transaction->requestLength;
+  requestFrame.castRequest();
+  currentTransaction = transaction;
+  if(onReceived) onReceived(this);
+  currentTransaction = 0;
+  release(transaction);
+}
+
+void ModbusTCPMaster::release(ModbusTCPTransaction *transaction){
+  transaction->requestLength = 0;
+  transaction->nextFree = freeHead;
+  freeHead = (uint16_t)(transaction - window);
+  inFlight --;
+}
+
+
+/*******************************************Modbus TCP 多设备主站引擎*******************************************/
+bool ModbusTCPDevice::setAddress(const char *host, uint16_t devicePort){
+  in_addr addr;
+  if(host == 0 || inet_pton(AF_INET, host, &addr) != 1) return false;
+  address = addr.s_addr;
+  port = devicePort;
+  return true;
+}
+
+ModbusTCPMasterEngine::ModbusTCPMasterEngine(){
+  onReceived = 0;
+  onConnectionChanged = 0;
+  connectTimeout = 3000;
+  responseTimeout = 1000;
+  reconnectDelay = 5000;
+  failType = RcvNoFail;
+  epollFd = -1;
+  devices = 0;
+  deviceCount = 0;
+  connectedCount = 0;
+  buffers = 0;
+  bufferCount = 0;
+  freeBuffer = NoIndex;
+  timerResolution = 10;
+  wheelTick = 0;
+  currentTick = 0;
+  lastMillis = 0;
+  tickRemainder = 0;
+  clearStatics();
+}
+
+ModbusTCPMasterEngine::~ModbusTCPMasterEngine(){
+  end();
+}
+
+void ModbusTCPMasterEngine::clearStatics(){
+  rxPacks = 0;
+  rxFailPacks = 0;
+  txPacks = 0;
+  timedoutPacks = 0;
+  connects = 0;
+  disconnects = 0;
+}
+
+bool ModbusTCPMasterEngine::begin(ModbusTCPDevice *deviceArray, uint16_t argDeviceCount, ModbusTCPBuffer *bufferPool, uint16_t argBufferCount, uint16_t timerResolutionMs){
+  end();
+  if(deviceArray == 0 || argDeviceCount == 0 || argDeviceCount == NoIndex || argBufferCount == NoIndex) return false;
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if(epollFd < 0) return false;
+  devices = deviceArray;
+  deviceCount = argDeviceCount;
+  buffers = bufferPool;
+  bufferCount = bufferPool ? argBufferCount : 0;
+  for(uint16_t i=0; i<bufferCount; i++){ //建立空闲链表
+    buffers[i].length = 0;
+    buffers[i].nextFree = (i+1 < bufferCount) ? (uint16_t)(i+1) : NoIndex;
+  }
+  freeBuffer = bufferCount ? 0 : NoIndex;
+  timerResolution = timerResolutionMs ? timerResolutionMs : 1;
+  for(uint16_t i=0; i<TimerWheelSize; i++) wheel[i] = NoIndex;
+  wheelTick = 0;
+  currentTick = 0;
+  lastMillis = millis();
+  tickRemainder = 0;
+  connectedCount = 0;
+  for(uint16_t i=0; i<deviceCount; i++){
+    ModbusTCPDevice &d = devices[i];
+    d.fd = -1;
+    d.state = ModbusTCPDevice::Disconnected;
+    d.requestLength = 0;
+    d.rxBuffer = NoIndex;
+    d.txBuffer = NoIndex;
+    d.timerSlot = NoIndex;
+    setTimer(i, 0);  //第一次update时开始连接
+  }
+  return true;
+}
+
+void ModbusTCPMasterEngine::end(){
+  for(uint16_t i=0; i<deviceCount; i++){
+    if(devices[i].fd >= 0) close(devices[i].fd);
+    devices[i].fd = -1;
+    devices[i].state = ModbusTCPDevice::Disconnected;
+  }
+  if(epollFd >= 0) close(epollFd);
+  epollFd = -1;
+  devices = 0;
+  deviceCount = 0;
+  connectedCount = 0;
+  buffers = 0;
+  bufferCount = 0;
+  freeBuffer = NoIndex;
+}
+
+uint16_t ModbusTCPMasterEngine::update(int timeoutMs){
+  if(epollFd < 0) return 0;
+  if(timeoutMs < 0 || timeoutMs > timerResolution) timeoutMs = timerResolution;  //不能睡过下一个时间轮刻度
+  epoll_event events[256];
+  int n = epoll_wait(epollFd, events, 256, timeoutMs);
+  for(int i=0; i<n; i++){
+    uint16_t device = (uint16_t)events[i].data.u32;
+    ModbusTCPDevice &d = devices[device];
+    if(d.fd < 0) continue;  //本轮中已被断开
+    if(d.state == ModbusTCPDevice::Connecting){
+      finishConnect(device);
+      continue;
+    }
+    if(events[i].events & (EPOLLERR | EPOLLHUP)){
+      drop(device);
+      continue;
+    }
+    if(events[i].events & EPOLLOUT) onWritable(device);
+    if(d.fd >= 0 && (events[i].events & EPOLLIN)) onReadable(device);
+  }
+  advanceTimers();
+  return n > 0 ? (uint16_t)n : 0;
+}
+
+void ModbusTCPMasterEngine::watch(uint16_t device, uint32_t events, int op){
+  epoll_event ev;
+  ev.events = events;
+  ev.data.u32 = device;
+  epoll_ctl(epollFd, op, devices[device].fd, &ev);
+}
+
+void ModbusTCPMasterEngine::startConnect(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  d.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(d.fd < 0){
+    setTimer(device, reconnectDelay);
+    return;
+  }
+  int enable = 1;
+  setsockopt(d.fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(d.port);
+  addr.sin_addr.s_addr = d.address;
+  if(connect(d.fd, (sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS){
+    close(d.fd);
+    d.fd = -1;
+    setTimer(device, reconnectDelay);
+    return;
+  }
+  d.state = ModbusTCPDevice::Connecting;  //连接结果由EPOLLOUT通知, 本机回环也按异步处理
+  watch(device, EPOLLOUT, EPOLL_CTL_ADD);
+  setTimer(device, connectTimeout);
+}
+
+void ModbusTCPMasterEngine::finishConnect(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if(getsockopt(d.fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0){
+    drop(device);
+    return;
+  }
+  cancelTimer(device);
+  d.state = ModbusTCPDevice::Idle;
+  watch(device, EPOLLIN, EPOLL_CTL_MOD);
+  connectedCount ++;
+  connects ++;
+  if(onConnectionChanged) onConnectionChanged(this, device, true);
+}
+
+//断开连接并安排重连, 在途请求以RcvConnectionLost结束
+void ModbusTCPMasterEngine::drop(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  bool wasConnected = d.isConnected();
+  bool wasWaiting = d.state == ModbusTCPDevice::WaitResponse;
+  if(d.fd >= 0){
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, d.fd, 0);
+    close(d.fd);
+  }
+  d.fd = -1;
+  d.state = ModbusTCPDevice::Disconnected;
+  freeBufferOf(d.rxBuffer);
+  freeBufferOf(d.txBuffer);
+  setTimer(device, reconnectDelay);
+  if(wasConnected){
+    connectedCount --;
+    disconnects ++;
+  }
+  if(wasWaiting){
+    failType = RcvConnectionLost;
+    rxFailPacks ++;
+    rxFrame.validDataLength = 0;
+    complete(device);
+  }
+  if(wasConnected && onConnectionChanged) onConnectionChanged(this, device, false);
+}
+
+void ModbusTCPMasterEngine::disconnect(uint16_t device){
+  if(device >= deviceCount || devices[device].fd < 0) return;
+  drop(device);
+}
+
+bool ModbusTCPMasterEngine::transmit(uint16_t device, uint8_t unitID){
+  if(txFrame.pack == 0) return false;
+  return enqueue(device, unitID, txFrame.pack->getSize());
+}
+
+bool ModbusTCPMasterEngine::transmitRaw(uint16_t device, uint8_t unitID, uint16_t length){
+  if(length < 2 || length > ModbusTCP::MaxPDUSize+1) return false;
+  return enqueue(device, unitID, length);
+}
+
+//MBAP头和txFrame一次sendmsg发出, 只有发送缓冲已满才借缓冲保存剩余部分
+bool ModbusTCPMasterEngine::enqueue(uint16_t device, uint8_t unitID, uint16_t length){
+  if(device >= deviceCount || !devices[device].availableToTransmit()) return false;
+  ModbusTCPDevice &d = devices[device];
+  d.transactionID ++;
+  *(txFrame.station) = unitID;
+  uint8_t header[ModbusTCP::MBAPHeaderSize-1];
+  ModbusTCP::buildHeader(header, d.transactionID, length);
+  uint16_t total = (uint16_t)(sizeof(header) + length);
+  iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = txFrame.buffer;
+  iov[1].iov_len = length;
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  ssize_t n = sendmsg(d.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if(n < 0){
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+      drop(device);
+      return false;
+    }
+    n = 0;
+  }
+  if(n < total){
+    d.txBuffer = allocBuffer();
+    if(d.txBuffer == NoIndex){
+      drop(device);  //发送缓冲已满且没有可借的缓冲, 连接已不可用
+      return false;
+    }
+    ModbusTCPBuffer &buf = buffers[d.txBuffer];
+    buf.length = 0;
+    for(uint16_t i=(uint16_t)n; i<total; i++){
+      buf.data[buf.length++] = i < sizeof(header) ? header[i] : txFrame.buffer[i-sizeof(header)];
+    }
+    watch(device, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+  }
+  d.requestLength = (uint8_t)(length < ModbusTCPDevice::RequestHeaderSize ? length : ModbusTCPDevice::RequestHeaderSize);
+  memcpy(d.request, txFrame.buffer, d.requestLength);
+  d.state = ModbusTCPDevice::WaitResponse;
+  setTimer(device, responseTimeout);
+  txPacks ++;
+  return true;
+}
+
+void ModbusTCPMasterEngine::onWritable(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  if(d.txBuffer == NoIndex){
+    watch(device, EPOLLIN, EPOLL_CTL_MOD);
+    return;
+  }
+  ModbusTCPBuffer &buf = buffers[d.txBuffer];
+  ssize_t n = send(d.fd, buf.data, buf.length, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if(n < 0){
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) drop(device);
+    return;
+  }
+  buf.length -= (uint16_t)n;
+  if(buf.length){
+    memmove(buf.data, buf.data+n, buf.length);
+    return;
+  }
+  freeBufferOf(d.txBuffer);
+  watch(device, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+//没有不完整的回复时直接读到共享缓冲, 否则接在借用的缓冲后面
+void ModbusTCPMasterEngine::onReadable(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  uint8_t *data = scratch;
+  uint16_t capacity = RxScratchSize;
+  uint16_t offset = 0;
+  if(d.rxBuffer != NoIndex){
+    data = buffers[d.rxBuffer].data;
+    offset = buffers[d.rxBuffer].length;
+    capacity = ModbusTCP::MaxADUSize;
+  }
+  ssize_t n = recv(d.fd, data+offset, capacity-offset, MSG_DONTWAIT);
+  if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)){
+    drop(device);
+    return;
+  }
+  if(n < 0) return;
+  consume(device, data, (uint16_t)(offset + n));
+}
+
+bool ModbusTCPMasterEngine::consume(uint16_t device, uint8_t *data, uint16_t length){
+  ModbusTCPDevice &d = devices[device];
+  uint16_t offset = 0;
+  while(length - offset >= ModbusTCP::MBAPHeaderSize){
+    uint8_t *adu = data + offset;
+    uint16_t aduPayload = ModbusTCP::getU16(adu+4);  //单元号+PDU
+    if(ModbusTCP::getU16(adu+2) != 0 || aduPayload < 2 || aduPayload > ModbusTCP::MaxPDUSize+1){
+      rxFailPacks ++;
+      drop(device);  //无法再找到下一帧的边界
+      return false;
+    }
+    uint16_t aduLength = (uint16_t)(aduPayload + ModbusTCP::MBAPHeaderSize - 1);
+    if(length - offset < aduLength) break;
+    offset += aduLength;
+    if(d.state != ModbusTCPDevice::WaitResponse || ModbusTCP::getU16(adu) != d.transactionID){
+      rxFailPacks ++;  //已超时的旧回复, 丢弃
+      continue;
+    }
+    memcpy(rxFrame.buffer, adu+ModbusTCP::MBAPHeaderSize-1, aduPayload);
+    rxFrame.validDataLength = aduPayload;
+    rxPacks ++;
+    if(rxFrame.castResponse()){
+      failType = RcvNoFail;
+    }else{
+      failType = RcvUnsupportedFunctionCode;
+      rxFailPacks ++;
+    }
+    cancelTimer(device);
+    d.state = ModbusTCPDevice::Idle;
+    complete(device);
+    if(d.fd < 0) return false;  //回调中断开了连接, 缓冲已释放
+  }
+  uint16_t remain = (uint16_t)(length - offset);
+  if(remain == 0){
+    freeBufferOf(d.rxBuffer);
+    return true;
+  }
+  if(d.rxBuffer == NoIndex){  //不完整的分段, 借一个缓冲保存
+    d.rxBuffer = allocBuffer();
+    if(d.rxBuffer == NoIndex){
+      rxFailPacks ++;
+      drop(device);
+      return false;
+    }
+  }
+  ModbusTCPBuffer &buf = buffers[d.rxBuffer];
+  memmove(buf.data, data+offset, remain);
+  buf.length = remain;
+  return true;
+}
+
+//还原请求帧的索引字段后回调; 写请求的数据部分没有保存, processResponse也不需要
+void ModbusTCPMasterEngine::complete(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  memcpy(requestFrame.buffer, d.request, d.requestLength);
+  requestFrame.validDataLength = d.requestLength;
+  requestFrame.castRequest();
+  if(onReceived) onReceived(this, device);
+}
+
+void ModbusTCPMasterEngine::onTimer(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  switch(d.state){
+    case ModbusTCPDevice::Disconnected:
+      startConnect(device);
+      break;
+    case ModbusTCPDevice::Connecting:  //连接超时
+      drop(device);
+      break;
+    case ModbusTCPDevice::WaitResponse:
+      if(d.txBuffer != NoIndex){  //请求还没发完, 流里留着半个ADU, 不能再接着发下一个请求, 只能断开重连
+        timedoutPacks ++;
+        drop(device);
+        break;
+      }
+      d.state = ModbusTCPDevice::Idle;
+      failType = RcvWaitTimedout;
+      rxFailPacks ++;
+      timedoutPacks ++;
+      rxFrame.validDataLength = 0;
+      complete(device);
+      break;
+    default:
+      break;
+  }
+}
+
+uint16_t ModbusTCPMasterEngine::allocBuffer(){
+  uint16_t index = freeBuffer;
+  if(index != NoIndex){
+    freeBuffer = buffers[index].nextFree;
+    buffers[index].length = 0;
+  }
+  return index;
+}
+
+void ModbusTCPMasterEngine::freeBufferOf(uint16_t &buffer){
+  if(buffer == NoIndex) return;
+  buffers[buffer].nextFree = freeBuffer;
+  freeBuffer = buffer;
+  buffer = NoIndex;
+}
+
+/***************************时间轮*****************************/
+//每个刻度一个双向链表, 节点就是设备状态块本身, 设置/取消定时器都是O(1)
+//超过一圈的定时器留在槽里, 每转一圈检查一次截止时间
+void ModbusTCPMasterEngine::setTimer(uint16_t device, uint32_t delayMs){
+  cancelTimer(device);
+  ModbusTCPDevice &d = devices[device];
+  d.timerDeadline = updateClock() + delayMs;
+  uint32_t tick = currentTick + (uint32_t)(((uint64_t)tickRemainder + delayMs + timerResolution - 1)/timerResolution);  //向上取整, 处理该刻度时一定已到期
+  if((int32_t)(tick - wheelTick) < 0) tick = wheelTick;  //已经过去的刻度放到下一个要处理的槽
+  uint16_t slot = (uint16_t)(tick % TimerWheelSize);
+  d.timerSlot = slot;
+  d.timerPrev = NoIndex;
+  d.timerNext = wheel[slot];
+  if(d.timerNext != NoIndex) devices[d.timerNext].timerPrev = device;
+  wheel[slot] = device;
+}
+
+void ModbusTCPMasterEngine::cancelTimer(uint16_t device){
+  ModbusTCPDevice &d = devices[device];
+  if(d.timerSlot == NoIndex) return;
+  if(d.timerPrev != NoIndex) devices[d.timerPrev].timerNext = d.timerNext;
+  else wheel[d.timerSlot] = d.timerNext;
+  if(d.timerNext != NoIndex) devices[d.timerNext].timerPrev = d.timerPrev;
+  d.timerSlot = NoIndex;
+}
+
+//刻度按经过的毫秒数累加, 而不是millis()/分辨率: 2^32不是分辨率的整数倍, 回绕时商会跳回0
+uint32_t ModbusTCPMasterEngine::updateClock(){
+  uint32_t now = millis();
+  uint32_t elapsed = (uint32_t)tickRemainder + (now - lastMillis);
+  lastMillis = now;
+  currentTick += elapsed / timerResolution;
+  tickRemainder = (uint16_t)(elapsed % timerResolution);
+  return now;
+}
+
+void ModbusTCPMasterEngine::advanceTimers(){
+  uint32_t now = updateClock();
+  uint32_t nowTick = currentTick;
+  if((int32_t)(nowTick - wheelTick) >= (int32_t)TimerWheelSize) wheelTick = nowTick - TimerWheelSize + 1;  //停顿太久, 每个槽只需检查一次
+  while((int32_t)(nowTick - wheelTick) >= 0){
+    uint16_t slot = (uint16_t)(wheelTick % TimerWheelSize);
+    wheelTick ++;  //回调中新设的定时器不会落到正在遍历的槽
+    while(true){  //回调可能改动同槽里其他设备的定时器, 每次都从槽头重新找到期的
+      uint16_t device = wheel[slot];
+      while(device != NoIndex && (int32_t)(now - devices[device].timerDeadline) < 0) device = devices[device].timerNext;
+      if(device == NoIndex) break;
+      cancelTimer(device);
+      onTimer(device);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,317 @@
+#pragma once
+#include "ModbusPack.h"
+
+//Modbus TCP (MBAP报文头) 仅在Linux上可用, 使用epoll单线程事件循环
+#if defined(__linux__)
+
+/*******************************************Modbus TCP*******************************************/
+//MBAP: 事务号(2) + 协议号(2, 固定0) + 长度(2, 单元号+PDU) + 单元号(1)
+//单元号放在ModbusFrame::buffer[0]的站号位置, PDU从buffer+1开始, 与RTU帧布局一致, 寄存器处理代码无需区分
+class ModbusTCP{
+public:
+  static const uint16_t DefaultPort = 502;
+  static const uint8_t MBAPHeaderSize = 7;     //含单元号
+  static const uint16_t MaxPDUSize = 253;
+  static const uint16_t MaxADUSize = MBAPHeaderSize + MaxPDUSize;  //260
+  static inline uint16_t getU16(const uint8_t *p){ return (uint16_t)((p[0] << 8) | p[1]); }
+  static inline void setU16(uint8_t *p, uint16_t value){
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)(value & 0xFF);
+  }
+  //header为6字节MBAP(不含单元号), 单元号在frameBuffer[0], 长度 = 单元号+PDU
+  static inline void buildHeader(uint8_t *header, uint16_t transactionID, uint16_t length){
+    setU16(header, transactionID);
+    setU16(header+2, 0);
+    setU16(header+4, length);
+  }
+};
+
+//每个客户端连接的状态, 由用户提供的连接池数组分配, 服务器运行中不再申请内存
+class ModbusTCPConnection{
+public:
+  int fd;                 //-1表示空闲
+  uint16_t rxLength;
+  uint16_t txLength;      //发送缓冲中尚未写出的字节, 不为0时暂停读取(背压)
+  uint16_t txOffset;
+  uint16_t nextFree;      //空闲链表
+  uint16_t transactionID; //当前正在处理的请求的事务号
+  uint16_t generation;    //每次接受新连接加1, 延迟回复时用来确认还是同一个客户端
+  uint8_t rxBuffer[ModbusTCP::MaxADUSize];
+  uint8_t txBuffer[ModbusTCP::MaxADUSize];
+  inline bool isOpen(){ return fd >= 0; }
+};
+
+class ModbusTCPServer;
+typedef void(*ModbusTCPCallbackOnReceived)(ModbusTCPServer *server);
+
+class ModbusTCPServer{
+public:
+  constexpr static uint8_t RcvNoFail = 0x00;
+  constexpr static uint8_t RcvUnsupportedFunctionCode = 0x04;
+
+  ModbusTCPCallbackOnReceived onReceived;  //在回调中处理rxFrame, 填写txFrame后调用transmit()
+  void *userData;
+  ModbusTCPConnection *currentConnection;  //正在回调的连接
+  uint8_t failType;
+
+  uint32_t rxPacks;
+  uint32_t rxFailPacks;
+  uint32_t txPacks;
+  uint32_t acceptedConnections;
+  uint32_t rejectedConnections;  //连接池已满
+
+  ModbusFrame txFrame;
+  ModbusFrame rxFrame;
+
+  ModbusTCPServer();
+  ~ModbusTCPServer();
+  bool begin(ModbusTCPConnection *connectionPool, uint16_t poolSize, uint16_t port = ModbusTCP::DefaultPort, const char *bindAddress = 0);
+  void end();
+  uint16_t update(int timeoutMs = 0);  //处理一轮epoll事件, 返回处理的事件数
+  bool transmit();
+  bool transmit(ModbusTCPConnection *connection, uint16_t transactionID, uint8_t unitID);  //延迟回复, 连接须仍是同一个客户端
+  bool transmitRaw(ModbusTCPConnection *connection, uint16_t transactionID, uint16_t length);  //txFrame.buffer原样发出, length为单元号+PDU长度
+  void closeConnection(ModbusTCPConnection *connection);
+  void clearStatics();
+
+  inline int getPollFd(){ return epollFd; }
+  inline uint16_t getConnectionCount(){ return connectionCount; }
+  inline uint16_t getConnectionIndex(ModbusTCPConnection *connection){ return (uint16_t)(connection - connections); }
+  inline ModbusTCPConnection *getConnection(uint16_t index){ return &connections[index]; }
+  inline uint16_t getConnectionPoolSize(){ return connectionPoolSize; }
+  inline uint16_t getTransactionID(){ return currentConnection ? currentConnection->transactionID : 0; }
+  inline uint8_t getUnitID(){ return rxFrame.getStation(); }
+  inline uint8_t getFailType(){ return failType; }
+  inline uint32_t getTxPacks(){ return txPacks; }
+  inline uint32_t getRxPacks(){ return rxPacks; }
+  inline uint32_t getRxFailPacks(){ return rxFailPacks; }
+private:
+  int listenFd;
+  int epollFd;
+  ModbusTCPConnection *connections;
+  uint16_t connectionPoolSize;
+  uint16_t connectionCount;
+  uint16_t freeHead;
+
+  void acceptConnections();
+  void onReadable(ModbusTCPConnection *connection);
+  bool onWritable(ModbusTCPConnection *connection);
+  void processConnection(ModbusTCPConnection *connection);
+  bool sendADU(ModbusTCPConnection *connection, uint16_t transactionID, uint8_t *frame, uint16_t length);
+  void replyDiagnose(ModbusTCPConnection *connection, uint8_t diagnoseCode);
+  void setWaitWritable(ModbusTCPConnection *connection, bool waitWritable);
+};
+
+
+/*******************************************Modbus TCP 主站*******************************************/
+//一个在途事务, 保存请求的单元号+PDU, 回复到达时用于还原requestFrame (processResponse需要请求作为索引)
+class ModbusTCPTransaction{
+public:
+  uint16_t transactionID;
+  uint16_t requestLength;  //0表示空闲
+  uint16_t nextFree;       //空闲链表
+  uint32_t sentTick;
+  uint8_t request[ModbusTCP::MaxPDUSize+1];
+  inline bool isInFlight(){ return requestLength != 0; }
+};
+
+class ModbusTCPMaster;
+typedef void(*ModbusTCPMasterCallbackOnReceived)(ModbusTCPMaster *master);
+
+//流水线主站: 同一连接上最多window个请求在途, 回复按事务号乱序匹配
+//两次update之间transmit的请求合并到一个发送缓冲, 由一次send发出
+class ModbusTCPMaster{
+public:
+  constexpr static uint8_t RcvNoFail = 0x00;
+  constexpr static uint8_t RcvWaitTimedout = 0x01;
+  constexpr static uint8_t RcvUnsupportedFunctionCode = 0x04;
+  constexpr static uint8_t RcvConnectionLost = 0x05;
+  static const uint16_t MaxWindowSize = 256;    //事务号低8位为窗口槽位
+  static const uint16_t TxBatchSize = 1460;     //一个以太网MSS
+  static const uint16_t RxBufferSize = 2048;
+
+  ModbusTCPMasterCallbackOnReceived onReceived;  //回复或超时, rxFrame是回复, requestFrame是对应的请求
+  ModbusTCPTransaction *currentTransaction;
+  uint32_t timeOut;  //单个事务的回复超时(us)
+  uint8_t failType;
+
+  uint32_t rxPacks;
+  uint32_t rxFailPacks;
+  uint32_t txPacks;
+  uint32_t timedoutPacks;
+
+  ModbusFrame txFrame;       //在此组包后调用transmit
+  ModbusFrame rxFrame;
+  ModbusFrame requestFrame;
+
+  ModbusTCPMaster();
+  ~ModbusTCPMaster();
+  bool begin(ModbusTCPTransaction *window, uint16_t windowSize, const char *host, uint16_t port = ModbusTCP::DefaultPort, uint32_t timeOutUs = 1000000);
+  void end();
+  bool connect();  //用begin的地址重新连接, 非阻塞
+  void update(int timeoutMs = 0);
+  bool availableToTransmit();
+  bool transmit(uint8_t unitID);
+  bool transmitRaw(uint8_t unitID, uint16_t length);  //length为单元号+PDU长度, 不经过txFrame.pack
+  bool flush();
+  void clearStatics();
+
+  inline bool isConnected(){ return fd >= 0 && !connecting; }
+  inline int getPollFd(){ return fd; }
+  inline uint16_t getInFlight(){ return inFlight; }
+  inline uint16_t getWindowSize(){ return windowSize; }
+  inline uint8_t getFailType(){ return failType; }
+  inline uint32_t getTxPacks(){ return txPacks; }
+  inline uint32_t getRxPacks(){ return rxPacks; }
+  inline uint32_t getRxFailPacks(){ return rxFailPacks; }
+private:
+  int fd;
+  bool connecting;
+  uint32_t address;  //网络字节序
+  uint16_t port;
+  ModbusTCPTransaction *window;
+  uint16_t windowSize;
+  uint16_t inFlight;
+  uint16_t freeHead;
+  uint8_t generation;  //事务号高8位, 区分同一槽位的新旧事务
+  uint16_t txLength;
+  uint16_t txOffset;
+  uint16_t rxLength;
+  uint8_t txBuffer[TxBatchSize];
+  uint8_t rxBuffer[RxBufferSize];
+
+  bool enqueue(uint8_t unitID, uint16_t length);
+  bool finishConnect();
+  void closeConnection();
+  void receive();
+  void processResponses();
+  void checkTimeouts();
+  void complete(ModbusTCPTransaction *transaction);
+  void release(ModbusTCPTransaction *transaction);
+};
+
+
+/*******************************************Modbus TCP 多设备主站引擎*******************************************/
+//一个引擎在一个epoll上管理成千上万台设备连接, 每台设备只占一个紧凑的状态块
+//收发使用引擎共享的缓冲, 只有TCP分段不完整或发送缓冲已满时才从缓冲池借一个ADU缓冲
+class ModbusTCPBuffer{
+public:
+  uint16_t length;
+  uint16_t nextFree;
+  uint8_t data[ModbusTCP::MaxADUSize];
+};
+
+class ModbusTCPDevice{
+public:
+  constexpr static uint8_t Disconnected = 0x00;  //等待重连定时器
+  constexpr static uint8_t Connecting = 0x01;
+  constexpr static uint8_t Idle = 0x02;          //已连接, 可以发送
+  constexpr static uint8_t WaitResponse = 0x03;
+  static const uint8_t RequestHeaderSize = 12;   //单元号+功能码+最多10字节索引字段(0x17最长), 用于还原requestFrame
+
+  uint32_t address;  //网络字节序
+  uint16_t port;
+  uint8_t state;
+  uint8_t requestLength;  //已保存的请求头长度
+  int fd;
+  uint16_t transactionID;
+  uint16_t rxBuffer;      //缓冲池序号, 0xFFFF表示没有不完整的回复
+  uint16_t txBuffer;      //缓冲池序号, 0xFFFF表示没有未发完的请求
+  uint16_t timerNext;     //时间轮链表
+  uint16_t timerPrev;
+  uint16_t timerSlot;
+  uint32_t timerDeadline;
+  uint8_t request[RequestHeaderSize];
+  void *userData;
+
+  bool setAddress(const char *host, uint16_t devicePort = ModbusTCP::DefaultPort);
+  inline bool isConnected(){ return state >= Idle; }
+  inline bool availableToTransmit(){ return state == Idle && txBuffer == 0xFFFF; }  //上一个请求发完才能发下一个
+};
+
+class ModbusTCPMasterEngine;
+typedef void(*ModbusTCPEngineCallbackOnReceived)(ModbusTCPMasterEngine *engine, uint16_t device);
+typedef void(*ModbusTCPEngineCallbackOnConnection)(ModbusTCPMasterEngine *engine, uint16_t device, bool connected);
+
+class ModbusTCPMasterEngine{
+public:
+  constexpr static uint8_t RcvNoFail = 0x00;
+  constexpr static uint8_t RcvWaitTimedout = 0x01;
+  constexpr static uint8_t RcvUnsupportedFunctionCode = 0x04;
+  constexpr static uint8_t RcvConnectionLost = 0x05;
+  static const uint16_t NoIndex = 0xFFFF;
+  static const uint16_t TimerWheelSize = 512;
+  static const uint16_t RxScratchSize = 4096;
+
+  ModbusTCPEngineCallbackOnReceived onReceived;        //回复/超时/断线, rxFrame是回复, requestFrame是还原的请求(只含索引字段)
+  ModbusTCPEngineCallbackOnConnection onConnectionChanged;
+  uint32_t connectTimeout;   //ms
+  uint32_t responseTimeout;  //ms
+  uint32_t reconnectDelay;   //ms, 断线或连接失败后等待多久重连
+  uint8_t failType;
+
+  uint32_t rxPacks;
+  uint32_t rxFailPacks;
+  uint32_t txPacks;
+  uint32_t timedoutPacks;
+  uint32_t connects;
+  uint32_t disconnects;
+
+  ModbusFrame txFrame;
+  ModbusFrame rxFrame;
+  ModbusFrame requestFrame;
+
+  ModbusTCPMasterEngine();
+  ~ModbusTCPMasterEngine();
+  //devices需先setAddress; buffers为不完整分段借用的缓冲池, 数量远小于设备数即可
+  bool begin(ModbusTCPDevice *deviceArray, uint16_t deviceCount, ModbusTCPBuffer *bufferPool, uint16_t bufferCount, uint16_t timerResolutionMs = 10);
+  void end();
+  uint16_t update(int timeoutMs = 0);
+  bool transmit(uint16_t device, uint8_t unitID);
+  bool transmitRaw(uint16_t device, uint8_t unitID, uint16_t length);  //length为单元号+PDU长度
+  void disconnect(uint16_t device);  //立即断开, 按reconnectDelay重连
+  void clearStatics();
+
+  inline int getPollFd(){ return epollFd; }
+  inline ModbusTCPDevice *getDevice(uint16_t device){ return &devices[device]; }
+  inline uint16_t getDeviceCount(){ return deviceCount; }
+  inline uint16_t getConnectedCount(){ return connectedCount; }
+  inline uint8_t getFailType(){ return failType; }
+  inline uint32_t getTxPacks(){ return txPacks; }
+  inline uint32_t getRxPacks(){ return rxPacks; }
+  inline uint32_t getRxFailPacks(){ return rxFailPacks; }
+private:
+  int epollFd;
+  ModbusTCPDevice *devices;
+  uint16_t deviceCount;
+  uint16_t connectedCount;
+  ModbusTCPBuffer *buffers;
+  uint16_t bufferCount;
+  uint16_t freeBuffer;
+  uint16_t timerResolution;
+  uint32_t wheelTick;      //下一个要处理的时间轮刻度
+  uint32_t currentTick;    //单调递增的刻度计数, 不随millis()回绕跳变
+  uint32_t lastMillis;
+  uint16_t tickRemainder;  //不足一个刻度的毫秒数, 留到下次累加
+  uint16_t wheel[TimerWheelSize];
+  uint8_t scratch[RxScratchSize];
+
+  void startConnect(uint16_t device);
+  void finishConnect(uint16_t device);
+  void drop(uint16_t device);
+  void onReadable(uint16_t device);
+  void onWritable(uint16_t device);
+  void onTimer(uint16_t device);
+  bool consume(uint16_t device, uint8_t *data, uint16_t length);
+  bool enqueue(uint16_t device, uint8_t unitID, uint16_t length);
+  void complete(uint16_t device);
+  void watch(uint16_t device, uint32_t events, int op);
+  uint16_t allocBuffer();
+  void freeBufferOf(uint16_t &buffer);
+  void setTimer(uint16_t device, uint32_t delayMs);
+  void cancelTimer(uint16_t device);
+  void advanceTimers();
+  uint32_t updateClock();
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "ModbusTermios.h"
+/* Linux termios 串口 */
+#if defined(__linux__)
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <linux/serial.h>
+
+static speed_t ModbusTermiosSpeed(uint32_t baud){
+  switch(baud){
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+  }
+  return B0;
+}
+
+ModbusTermiosTransport::ModbusTermiosTransport(){
+  kernelRS485 = false;
+  rtsOnSend = true;
+  fd = -1;
+  ownsFd = false;
+  timerFd = -1;
+  epollFd = -1;
+  frameTimeoutUs = 0;
+  receiveNs = armedNs = wakeNs = timerDeadlineNs = 0;
+  wakeBytes = 0;
+}
+
+ModbusTermiosTransport::~ModbusTermiosTransport(){
+  close();
+}
+
+bool ModbusTermiosTransport::open(const char *device, uint32_t baud, uint32_t config){
+  close();
+  int newFd = ::open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if(newFd < 0) return false;
+  if(!open(newFd, baud, config)){
+    ::close(newFd);
+    return false;
+  }
+  ownsFd = true;
+  return true;
+}
+
+bool ModbusTermiosTransport::open(int existingFd, uint32_t baud, uint32_t config){
+  close();
+  int flags = fcntl(existingFd, F_GETFL, 0);
+  if(flags < 0 || fcntl(existingFd, F_SETFL, flags | O_NONBLOCK) < 0) return false;
+  fd = existingFd;
+  ownsFd = false;
+  if(!configure(baud, config)){
+    fd = -1;
+    return false;
+  }
+  //低延迟模式: 驱动收到数据立即上报而不是攒满FIFO, pty和部分USB串口不支持, 失败时忽略
+  struct serial_struct serial;
+  if(ioctl(fd, TIOCGSERIAL, &serial) == 0){
+    serial.flags |= ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &serial);
+  }
+  if(kernelRS485){
+    struct serial_rs485 rs485 = {};
+    rs485.flags = SER_RS485_ENABLED | (rtsOnSend ? SER_RS485_RTS_ON_SEND : SER_RS485_RTS_AFTER_SEND);
+    if(ioctl(fd, TIOCSRS485, &rs485) < 0) kernelRS485 = false;  //驱动不支持时退回RTS控制
+  }
+  if(!kernelRS485) setRTS(!rtsOnSend);
+  tcflush(fd, TCIOFLUSH);
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if(timerFd < 0 || epollFd < 0){
+    close();
+    return false;
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+  ev.data.fd = timerFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+  receiveNs = armedNs = wakeNs = timerDeadlineNs = 0;
+  wakeBytes = 0;
+  return true;
+}
+
+void ModbusTermiosTransport::close(){
+  if(epollFd >= 0) ::close(epollFd);
+  if(timerFd >= 0) ::close(timerFd);
+  epollFd = timerFd = -1;
+  if(fd >= 0 && ownsFd) ::close(fd);
+  fd = -1;
+  ownsFd = false;
+}
+
+bool ModbusTermiosTransport::begin(uint32_t baud, uint32_t config){
+  if(fd < 0) return false;
+  return configure(baud, config);
+}
+
+bool ModbusTermiosTransport::configure(uint32_t baud, uint32_t config){
+  speed_t speed = ModbusTermiosSpeed(baud);
+  if(speed == B0) return false;
+  struct termios tio;
+  if(tcgetattr(fd, &tio) < 0) return false;
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CRTSCTS | CSTOPB | PARENB | PARODD | CSIZE);
+  tio.c_cflag |= CS8;
+  switch(config){
+    case SERIAL_8E1: tio.c_cflag |= PARENB; break;
+    case SERIAL_8O1: tio.c_cflag |= PARENB | PARODD; break;
+    case SERIAL_8N2: tio.c_cflag |= CSTOPB; break;
+    case SERIAL_8E2: tio.c_cflag |= PARENB | CSTOPB; break;
+    case SERIAL_8O2: tio.c_cflag |= PARENB | PARODD | CSTOPB; break;
+    default: break;  //SERIAL_8N1
+  }
+  //VTIME的单位是0.1s, 远大于t3.5, 不能用来分帧: 设为VMIN=0/VTIME=0的纯非阻塞读, 帧间隔由ModbusRS485按时间戳判断
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+  cfsetispeed(&tio, speed);
+  cfsetospeed(&tio, speed);
+  return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+int ModbusTermiosTransport::available(){
+  if(timerDeadlineNs && nowNanos() >= timerDeadlineNs) drainFrameTimer();  //帧间隔已到期, 这次update就会处理帧结束
+  int n = 0;
+  if(fd < 0 || ioctl(fd, FIONREAD, &n) < 0) return 0;
+  return n;
+}
+
+size_t ModbusTermiosTransport::readBytes(uint8_t *data, size_t length){
+  if(fd < 0) return 0;
+  ssize_t n = ::read(fd, data, length);
+  if(n <= 0) return 0;
+  if(wakeNs && n <= wakeBytes){  //唤醒时就已到达的数据, 用唤醒时间而不是处理时间
+    receiveNs = wakeNs;
+    wakeBytes -= n;
+  }else{
+    receiveNs = nowNanos();
+    wakeNs = 0;
+  }
+  drainFrameTimer();  //之前的到期已被这批数据取代
+  armFrameTimer();
+  return (size_t)n;
+}
+
+size_t ModbusTermiosTransport::writeBytes(const uint8_t *data, size_t length){
+  size_t written = 0;
+  while(fd >= 0 && written < length){
+    ssize_t n = ::write(fd, data+written, length-written);
+    if(n > 0){
+      written += n;
+    }else if(n < 0 && errno == EINTR){
+      continue;
+    }else if(n < 0 && errno == EAGAIN){  //发送缓冲区满, 等待可写
+      struct pollfd p = {fd, POLLOUT, 0};
+      if(poll(&p, 1, 1000) <= 0) break;
+    }else{
+      break;
+    }
+  }
+  return written;
+}
+
+void ModbusTermiosTransport::beginTransmission(){
+  if(!kernelRS485) setRTS(rtsOnSend);
+}
+
+void ModbusTermiosTransport::endTransmission(){
+  if(fd < 0) return;
+  tcdrain(fd);  //等最后一个字节移出移位寄存器再切换方向
+  if(!kernelRS485) setRTS(!rtsOnSend);
+}
+
+uint32_t ModbusTermiosTransport::micros(){
+  return (uint32_t)(nowNanos()/1000);
+}
+
+uint32_t ModbusTermiosTransport::receiveMicros(){
+  return (uint32_t)(receiveNs/1000);
+}
+
+void ModbusTermiosTransport::setFrameTimeout(uint32_t us){
+  frameTimeoutUs = us;
+  armedNs = 0;
+  armFrameTimer();
+}
+
+//定时器在最后一批数据之后的帧间隔到期时触发, 由readBytes()设定, 所以只用getPollFd()而不调用wait()时也能等到帧结束
+void ModbusTermiosTransport::armFrameTimer(){
+  if(timerFd < 0 || !frameTimeoutUs || !receiveNs || receiveNs == armedNs) return;
+  uint64_t deadline = receiveNs + (uint64_t)frameTimeoutUs*1000 + 1000;  //多1us, 保证micros()-lastTick > timeOut
+  struct itimerspec its = {};
+  its.it_value.tv_sec = deadline / 1000000000ULL;
+  its.it_value.tv_nsec = deadline % 1000000000ULL;
+  timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, 0);
+  armedNs = receiveNs;
+  timerDeadlineNs = deadline;
+}
+
+//读走到期次数, 否则timerFd一直可读, 调用者的epoll会空转; 内核还没触发时保留期限, 下次再读
+void ModbusTermiosTransport::drainFrameTimer(){
+  if(timerFd < 0) return;
+  uint64_t expirations;
+  if(::read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) timerDeadlineNs = 0;
+}
+
+bool ModbusTermiosTransport::wait(uint32_t timeoutUs){
+  if(epollFd < 0) return false;
+  armFrameTimer();
+  struct epoll_event events[2];
+  int timeoutMs = timeoutUs == WaitForever ? -1 : (int)((timeoutUs + 999) / 1000);  //向上取整, 不早于期限醒来
+  int n = epoll_wait(epollFd, events, 2, timeoutMs);
+  for(int i=0; i<n; i++){
+    if(events[i].data.fd == timerFd){
+      drainFrameTimer();
+    }else{
+      wakeNs = nowNanos();
+      wakeBytes = available();
+    }
+  }
+  return n > 0;
+}
+
+uint64_t ModbusTermiosTransport::nowNanos(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void ModbusTermiosTransport::setRTS(bool level){
+  int bits = TIOCM_RTS;
+  ioctl(fd, level ? TIOCMBIS : TIOCMBIC, &bits);  //pty没有调制解调器线, 失败时忽略
+}
+
+#endif
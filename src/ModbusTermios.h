@@ -0,0 +1,51 @@
+#pragma once
+#include "ModbusTransport.h"
+
+//Linux串口(termios)传输层, 可用于/dev/ttyS*、/dev/ttyUSB*和pty
+#if defined(__linux__)
+
+/*******************************************Linux termios 串口*******************************************/
+class ModbusTermiosTransport : public ModbusTransport{
+public:
+  bool kernelRS485;   //使用内核的RS485模式(TIOCSRS485)由驱动控制方向, 否则用RTS控制
+  bool rtsOnSend;     //RTS控制方向时发送期间的RTS电平
+
+  ModbusTermiosTransport();
+  ~ModbusTermiosTransport();
+  bool open(const char *device, uint32_t baud = 9600, uint32_t config = SERIAL_8N1);
+  bool open(int existingFd, uint32_t baud, uint32_t config);  //使用已打开的描述符(例如openpty), 不负责关闭
+  void close();
+  bool begin(uint32_t baud, uint32_t config);  //重新设置波特率和帧格式
+  inline int getFd(){ return fd; }
+  inline int getPollFd(){ return epollFd; }  //串口可读或帧间隔到期时可读, 可以加入调用者自己的epoll
+  inline bool isOpen(){ return fd >= 0; }
+
+  int available();
+  size_t readBytes(uint8_t *data, size_t length);
+  size_t writeBytes(const uint8_t *data, size_t length);
+  void beginTransmission();
+  void endTransmission();
+  uint32_t micros();
+  uint32_t receiveMicros();
+  void setFrameTimeout(uint32_t us);
+  bool wait(uint32_t timeoutUs);
+private:
+  int fd;
+  bool ownsFd;
+  int timerFd;   //帧间隔定时器, readBytes()每收到一批数据重新设定
+  int epollFd;   //串口fd和timerFd
+  uint32_t frameTimeoutUs;
+  uint64_t receiveNs;   //最近一批数据的到达时间
+  uint64_t armedNs;     //定时器对应的receiveNs
+  uint64_t timerDeadlineNs;  //定时器到期时间, 到期次数读走后为0
+  uint64_t wakeNs;      //wait()被串口唤醒的时间, 此时已在缓冲区的数据按这个时间计
+  int wakeBytes;
+
+  bool configure(uint32_t baud, uint32_t config);
+  void setRTS(bool level);
+  void armFrameTimer();
+  void drainFrameTimer();
+  static uint64_t nowNanos();
+};
+
+#endif
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "ModbusPack.h"
+
+//没有Arduino串口配置常量的平台(例如Linux)使用ESP32的取值, 传输层只按常量比较, 不解析具体数值
+#ifndef SERIAL_8N1
+#define SERIAL_8N1 0x800001c
+#define SERIAL_8N2 0x800003c
+#define SERIAL_8E1 0x800001e
+#define SERIAL_8E2 0x800003e
+#define SERIAL_8O1 0x800001f
+#define SERIAL_8O2 0x800003f
+#endif
+
+/*******************************************字节传输层*******************************************/
+//ModbusRS485只负责RTU分帧和计时, 字节的收发、方向控制和时间戳都经过这个接口
+//Arduino上默认由RS485库适配, Linux上可以用ModbusTermiosTransport或其他实现
+class ModbusTransport{
+public:
+  static const uint32_t WaitForever = 0xFFFFFFFF;
+
+  virtual ~ModbusTransport(){}
+  virtual bool begin(uint32_t baud, uint32_t config){ (void)baud; (void)config; return true; }
+  virtual int available() = 0;
+  virtual size_t readBytes(uint8_t *data, size_t length) = 0;  //不阻塞, 返回实际读到的字节数
+  virtual size_t writeBytes(const uint8_t *data, size_t length) = 0;
+  virtual void beginTransmission() = 0;  //切换到发送方向
+  virtual void endTransmission() = 0;    //等待发送完毕后切回接收方向
+  virtual uint32_t micros() = 0;         //微秒时间戳, 允许回绕
+
+  //以下为可选功能, 默认实现等价于轮询
+  virtual uint32_t receiveMicros(){ return micros(); }  //当前这批数据的到达时间, 用于判断帧间隔
+  virtual void setFrameTimeout(uint32_t us){ (void)us; }  //帧间隔(t3.5), 传输层可以在间隔到期时唤醒wait()
+  virtual bool wait(uint32_t timeoutUs){ (void)timeoutUs; return true; }  //阻塞到收到数据、帧间隔到期或超时
+  virtual int getPollFd(){ return -1; }  //可以交给epoll/select等待的描述符, 不支持时返回-1
+
+  //一个字符在线上占用的位数, 用于计算t3.5和字符时间
+  static uint8_t getCharacterBits(uint32_t config){
+    switch(config){
+      case SERIAL_8N1:
+        return 11; //1 start bit + 8 data bits + 1 stop bit + 2 CRC bytes
+      case SERIAL_8E1:
+      case SERIAL_8O1:
+        return 12; //1 start bit + 8 data bits + 1 parity bit + 1 stop bit + 2 CRC bytes
+      case SERIAL_8N2:
+        return 12; //1 start bit + 8 data bits + 2 stop bits + 2 CRC bytes
+      case SERIAL_8E2:
+      case SERIAL_8O2:
+        return 13; //1 start bit + 8 data bits + 1 parity bit + 2 stop bits + 2 CRC bytes
+      default:
+        return 11; //Default to SERIAL_8N1
+    }
+    return 11;
+  }
+
+  //ModbusFrame::write的钩子, 整帧交给writeBytes
+  static size_t writeHook(void *context, const ModbusIOVec *iov, uint8_t iovCount){
+    ModbusTransport *transport = (ModbusTransport*)context;
+    size_t written = 0;
+    for(uint8_t i=0; i<iovCount; i++) written += transport->writeBytes(iov[i].data, iov[i].length);
+    return written;
+  }
+};
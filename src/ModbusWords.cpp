@@ -0,0 +1,45 @@
+#include "ModbusWords.h"
+#include <string.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+//交换每个16位字的两个字节, dst和src不重叠
+static void swapPairs(uint8_t *dst, const uint8_t *src, uint16_t count){
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    memcpy(dst, src, (size_t)count * 2);   //大端主机无需转换
+#else
+    uint16_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for(; i + 8 <= count; i += 8){
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i * 2));
+        _mm_storeu_si128((__m128i*)(dst + i * 2), _mm_shuffle_epi8(v, shuffle));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    for(; i + 8 <= count; i += 8){
+        vst1q_u8(dst + i * 2, vrev16q_u8(vld1q_u8(src + i * 2)));
+    }
+#endif
+    for(; i < count; i++){
+        uint16_t w;
+        memcpy(&w, src + i * 2, 2);
+#if defined(__GNUC__)
+        w = __builtin_bswap16(w);
+#else
+        w = (uint16_t)((w << 8) | (w >> 8));
+#endif
+        memcpy(dst + i * 2, &w, 2);
+    }
+#endif
+}
+
+void ModbusWords::toBigEndian(uint8_t *dst, const uint16_t *src, uint16_t count){
+    swapPairs(dst, (const uint8_t*)src, count);
+}
+
+void ModbusWords::fromBigEndian(uint16_t *dst, const uint8_t *src, uint16_t count){
+    swapPairs((uint8_t*)dst, src, count);
+}
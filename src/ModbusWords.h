@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+/*******************************************寄存器块字节序转换*******************************************/
+//Modbus寄存器按大端存放, 整块转换时一次处理16字节(SSSE3/NEON), 否则用__builtin_bswap16由编译器向量化
+class ModbusWords{
+public:
+  //主机字序数组 -> Modbus大端字节流
+  static void toBigEndian(uint8_t *dst, const uint16_t *src, uint16_t count);
+  //Modbus大端字节流 -> 主机字序数组
+  static void fromBigEndian(uint16_t *dst, const uint8_t *src, uint16_t count);
+};